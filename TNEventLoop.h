@@ -0,0 +1,678 @@
+// -*- mode: C++; coding: utf-8-unix -*-
+#ifndef TNEVENTLOOP_H_INCLUDED
+#define TNEVENTLOOP_H_INCLUDED
+
+#include "TelnetNode.h"
+
+// Coroutines (C++20) : session logic as straight-line code on one thread.
+//
+//   TNTask<> Session( TNEventLoop& loop, TNSession session )
+//   {
+//       co_await session.Send( "login: " );
+//       std::string name;
+//       if ( !co_await session.ReadLine( name, 30000 ) )
+//           co_return; // hung up or timed out
+//       ...
+//   }
+//
+//   TNTask<> Acceptor( TNEventLoop& loop )
+//   {
+//       for (;;)
+//           loop.Spawn( Session(loop, co_await loop.Accept()) );
+//   }
+//
+// * TNEventLoop runs every task on the thread calling Run; the receive
+//   threads only queue messages, so tasks need no locking
+// * An await that can complete at once (queued line, Send) does not suspend
+// * Sends go through SendText and still block when the peer's socket
+//   buffer is full
+// * GCC 12 evaluates a co_await on the right of && / || even when the left
+//   side decides; test such conditions in separate statements
+#if defined(__cpp_impl_coroutine) && !defined(TN_DISABLE_COROUTINES)
+#include <coroutine>
+#include <deque>
+#include <exception>
+
+class TNEventLoop;
+
+template <typename T = void>
+class TNTask;
+
+// Storage of a task's result; the void case has none.
+template <typename T>
+struct TNTaskResult
+{
+    T Value;
+
+    TNTaskResult()
+        : Value()
+        {}
+
+    void return_value( T value )
+        { Value = value; }
+
+    T Take()
+        { return Value; }
+};
+
+template <>
+struct TNTaskResult<void>
+{
+    void return_void()
+        {}
+
+    void Take()
+        {}
+};
+
+// TNTask : Lazily started coroutine. Either awaited by another task, which
+// resumes when it ends, or handed over to TNEventLoop::Spawn.
+template <typename T>
+class TNTask
+{
+public:
+    struct promise_type : TNTaskResult<T>
+    {
+        std::coroutine_handle<> Continuation;
+        TNEventLoop*            pLoop; // set for spawned tasks, which free themselves
+
+        promise_type()
+            : Continuation()
+            , pLoop(NULL)
+            {}
+
+        TNTask get_return_object()
+            { return TNTask( std::coroutine_handle<promise_type>::from_promise(*this) ); }
+
+        std::suspend_always initial_suspend() noexcept
+            { return std::suspend_always(); }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+                { return false; }
+
+            std::coroutine_handle<> await_suspend( std::coroutine_handle<promise_type> handle ) noexcept;
+
+            void await_resume() noexcept
+                {}
+        };
+
+        FinalAwaiter final_suspend() noexcept
+            { return FinalAwaiter(); }
+
+        void unhandled_exception()
+            { std::terminate(); }
+    };
+
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    explicit TNTask( Handle handle )
+        : m_Handle(handle)
+        {}
+
+    TNTask( TNTask&& other ) noexcept
+        : m_Handle(other.m_Handle)
+        { other.m_Handle = Handle(); }
+
+    ~TNTask()
+        {
+            if ( m_Handle )
+                m_Handle.destroy();
+        }
+
+    bool await_ready() const
+        { return !m_Handle || m_Handle.done(); }
+
+    std::coroutine_handle<> await_suspend( std::coroutine_handle<> continuation )
+        {
+            m_Handle.promise().Continuation = continuation;
+            return m_Handle; // run the child right away
+        }
+
+    T await_resume()
+        { return m_Handle.promise().Take(); }
+
+    // Gives up ownership; used by TNEventLoop::Spawn.
+    Handle Detach()
+        {
+            Handle handle = m_Handle;
+            m_Handle = Handle();
+            return handle;
+        }
+
+private:
+
+    TNTask( const TNTask& other );
+    TNTask& operator=( const TNTask& other );
+
+    Handle m_Handle;
+}; // End : TNTask
+
+
+class TNSession;
+
+// TNEventLoop : Drives the tasks of one TelnetNode on the calling thread.
+// Enables connection events on the node; create it before clients connect
+// so that Accept sees every one of them.
+class TNEventLoop
+{
+public:
+    explicit TNEventLoop( TelnetNode* pNode )
+        : m_pNode(pNode)
+        , m_Timers()
+        , m_Ready()
+        , m_Tasks()
+        , m_Peers()
+        , m_Accepted()
+        , m_pAcceptor(NULL)
+        , m_StopMutex()
+        , m_bStop(false)
+        {
+            m_pNode->SetConnectionEvents( true );
+            m_Timers.Reset( Now() );
+            if ( !m_pNode->IsServer() )
+                m_Peers[0]; // the client's only peer exists from the start
+        }
+
+    ~TNEventLoop()
+        {
+            m_pNode->SetConnectionEvents( false );
+
+            // suspended tasks unlink their awaiters while being destroyed
+            while ( !m_Tasks.empty() )
+            {
+                std::coroutine_handle<> task = *m_Tasks.begin();
+                m_Tasks.erase( m_Tasks.begin() );
+                task.destroy();
+            }
+
+            for ( PeerMap::iterator it = m_Peers.begin(); it != m_Peers.end(); ++it )
+            {
+                for ( std::size_t i = 0; i < (*it).second.Messages.size(); ++i )
+                    m_pNode->DeleteReceivedText( (*it).second.Messages[i] );
+            }
+        }
+
+    TelnetNode* Node()
+        { return m_pNode; }
+
+    // Starts the task at once; the loop owns it from then on.
+    template <typename T>
+    void Spawn( TNTask<T>&& task )
+        {
+            typename TNTask<T>::Handle handle = task.Detach();
+            handle.promise().pLoop = this;
+            m_Tasks.insert( handle );
+            handle.resume();
+        }
+
+    // Runs until Stop is called or no task is left.
+    void Run()
+        {
+            while ( !IsStopped() && !m_Tasks.empty() )
+                RunOnce( 100 );
+        }
+
+    // Dispatches what arrived, firing due timers, then resumes every task
+    // that became ready. Waits up to uTimeoutMs when there is nothing to do.
+    void RunOnce( unsigned int uTimeoutMs )
+        {
+            if ( m_Ready.empty() )
+            {
+                unsigned int wait = uTimeoutMs;
+                if ( !m_Timers.Empty() )
+                {
+                    // sleep until the next occupied slot, not just one tick
+                    unsigned long long wakeMs = m_Timers.NextTick() * m_Timers.TickMs();
+                    unsigned long long nowMs  = TNClock::NowMs();
+                    wait = (wakeMs > nowMs) ? (unsigned int)std::min<unsigned long long>( wait, wakeMs - nowMs ) : 0;
+                }
+                m_pNode->WaitReceivedText( wait );
+            }
+
+            m_Timers.Advance( Now() );
+
+            TNMessagePtr pMsg = NULL;
+            while ( (pMsg = m_pNode->PopReceivedText()) != NULL )
+                Dispatch( pMsg );
+
+            while ( !m_Ready.empty() )
+            {
+                std::coroutine_handle<> handle = m_Ready.front();
+                m_Ready.pop_front();
+                handle.resume();
+            }
+        }
+
+    // Thread-safe. Run returns once the current pass is over.
+    void Stop()
+        {
+            m_StopMutex.Lock();
+            m_bStop = true;
+            m_StopMutex.Unlock();
+
+            m_pNode->WakeReceiver();
+        }
+
+    bool IsStopped()
+        {
+            m_StopMutex.Lock();
+            bool result = m_bStop;
+            m_StopMutex.Unlock();
+
+            return result;
+        }
+
+    // co_await loop.Sleep( ms ), with the 10 ms resolution of the wheel
+    class SleepAwaiter
+    {
+    public:
+        SleepAwaiter( TNEventLoop* pLoop, unsigned int uDelayMs )
+            : m_pLoop(pLoop)
+            , m_uDelayMs(uDelayMs)
+            , m_Timer(Expire, this)
+            , m_Handle()
+            {}
+
+        ~SleepAwaiter()
+            { m_pLoop->m_Timers.Remove( &m_Timer ); }
+
+        bool await_ready() const
+            { return m_uDelayMs == 0; }
+
+        void await_suspend( std::coroutine_handle<> handle )
+            {
+                m_Handle = handle;
+                m_pLoop->ArmTimer( &m_Timer, m_uDelayMs );
+            }
+
+        void await_resume()
+            {}
+
+    private:
+
+        static void Expire( TNTimerWheel& /*wheel*/, TNTimer* /*pTimer*/, void* arg )
+            {
+                SleepAwaiter* pThis = (SleepAwaiter*)arg;
+                pThis->m_pLoop->m_Ready.push_back( pThis->m_Handle );
+            }
+
+        TNEventLoop*            m_pLoop;
+        unsigned int            m_uDelayMs;
+        TNTimer                 m_Timer;
+        std::coroutine_handle<> m_Handle;
+    };
+
+    SleepAwaiter Sleep( unsigned int uDelayMs )
+        { return SleepAwaiter( this, uDelayMs ); }
+
+    // co_await loop.Accept() : the next client to connect (server only).
+    // One task at a time may wait here.
+    class AcceptAwaiter
+    {
+    public:
+        explicit AcceptAwaiter( TNEventLoop* pLoop )
+            : m_pLoop(pLoop)
+            , m_uClient(0)
+            , m_Handle()
+            {}
+
+        ~AcceptAwaiter()
+            {
+                if ( m_pLoop->m_pAcceptor == this )
+                    m_pLoop->m_pAcceptor = NULL;
+            }
+
+        bool await_ready()
+            {
+                if ( m_pLoop->m_Accepted.empty() )
+                    return false;
+
+                m_uClient = m_pLoop->m_Accepted.front();
+                m_pLoop->m_Accepted.pop_front();
+                return true;
+            }
+
+        void await_suspend( std::coroutine_handle<> handle )
+            {
+                assert( m_pLoop->m_pAcceptor == NULL );
+                m_Handle = handle;
+                m_pLoop->m_pAcceptor = this;
+            }
+
+        TNSession await_resume();
+
+    private:
+        friend class TNEventLoop;
+
+        TNEventLoop*            m_pLoop;
+        unsigned int            m_uClient;
+        std::coroutine_handle<> m_Handle;
+    };
+
+    AcceptAwaiter Accept()
+        {
+            assert( m_pNode->IsServer() );
+            return AcceptAwaiter( this );
+        }
+
+    // co_await session.ReadMessage() / ReadLine(). Completes with NULL when
+    // the peer is gone or the timeout (0: none) expires.
+    class ReadAwaiter
+    {
+    public:
+        ReadAwaiter( TNEventLoop* pLoop, unsigned int uClient, unsigned int uTimeoutMs, bool bLinesOnly )
+            : m_pLoop(pLoop)
+            , m_uClient(uClient)
+            , m_uTimeoutMs(uTimeoutMs)
+            , m_bLinesOnly(bLinesOnly)
+            , m_pMsg(NULL)
+            , m_Timer(Expire, this)
+            , m_Handle()
+            {}
+
+        ~ReadAwaiter()
+            {
+                m_pLoop->m_Timers.Remove( &m_Timer );
+                m_pLoop->RemoveReader( this );
+                if ( m_pMsg != NULL )
+                    m_pLoop->m_pNode->DeleteReceivedText( m_pMsg ); // not taken by await_resume
+            }
+
+        bool await_ready()
+            { return m_pLoop->Take( this ); }
+
+        void await_suspend( std::coroutine_handle<> handle )
+            {
+                m_Handle = handle;
+                m_pLoop->AddReader( this );
+                if ( m_uTimeoutMs > 0 )
+                    m_pLoop->ArmTimer( &m_Timer, m_uTimeoutMs );
+            }
+
+        // The caller owns the message; free it with DeleteReceivedText.
+        TNMessagePtr await_resume()
+            {
+                TNMessagePtr result = m_pMsg;
+                m_pMsg = NULL;
+                return result;
+            }
+
+    private:
+        friend class TNEventLoop;
+
+        static void Expire( TNTimerWheel& /*wheel*/, TNTimer* /*pTimer*/, void* arg )
+            {
+                ReadAwaiter* pThis = (ReadAwaiter*)arg;
+                pThis->m_pLoop->RemoveReader( pThis );
+                pThis->m_pLoop->m_Ready.push_back( pThis->m_Handle );
+            }
+
+        TNEventLoop*            m_pLoop;
+        unsigned int            m_uClient;
+        unsigned int            m_uTimeoutMs;
+        bool                    m_bLinesOnly;
+        TNMessagePtr            m_pMsg;
+        TNTimer                 m_Timer;
+        std::coroutine_handle<> m_Handle;
+    };
+
+    // As ReadAwaiter but for text only: frames are dropped, the line is
+    // copied without its "\r\n" and the result tells whether there was one.
+    class LineAwaiter : public ReadAwaiter
+    {
+    public:
+        LineAwaiter( TNEventLoop* pLoop, unsigned int uClient, unsigned int uTimeoutMs, std::string& line )
+            : ReadAwaiter(pLoop, uClient, uTimeoutMs, true)
+            , m_Line(line)
+            {}
+
+        bool await_resume()
+            {
+                TNMessagePtr pMsg = ReadAwaiter::await_resume();
+                if ( pMsg == NULL )
+                    return false;
+
+                std::size_t length = pMsg->Size;
+                while ( length > 0 && (pMsg->Text[length - 1] == '\n' || pMsg->Text[length - 1] == '\r') )
+                    --length;
+                m_Line.assign( pMsg->Text, length );
+                Node()->DeleteReceivedText( pMsg );
+
+                return true;
+            }
+
+    private:
+
+        TelnetNode* Node()
+            { return m_pLoop->m_pNode; }
+
+        std::string& m_Line;
+    };
+
+private:
+    friend class TNSession;
+
+    struct Peer
+    {
+        std::deque<TNMessagePtr> Messages;
+        ReadAwaiter*             pReader;
+        bool                     bClosed;
+
+        Peer()
+            : Messages()
+            , pReader(NULL)
+            , bClosed(false)
+            {}
+    };
+
+    typedef std::map<unsigned int, Peer> PeerMap;
+
+    template <typename T> friend class TNTask;
+
+    unsigned long long Now() const
+        { return TNClock::NowMs() / m_Timers.TickMs(); }
+
+    void ArmTimer( TNTimer* pTimer, unsigned int uDelayMs )
+        {
+            unsigned long long nowMs = TNClock::NowMs();
+            unsigned long long now = nowMs / m_Timers.TickMs();
+            if ( m_Timers.Empty() && now > m_Timers.Current() )
+                m_Timers.Reset( now );
+            // counted from the next tick boundary, so that it never fires early
+            unsigned long long start = (nowMs + m_Timers.TickMs() - 1) / m_Timers.TickMs();
+            m_Timers.Add( pTimer, start + m_Timers.ToTicks(uDelayMs) );
+        }
+
+    void Dispatch( TNMessagePtr pMsg )
+        {
+            unsigned int uClient = pMsg->ID;
+            if ( pMsg->Type == TNMessage_Connect )
+            {
+                m_pNode->DeleteReceivedText( pMsg );
+                m_Peers[uClient]; // may hold data that overtook the event
+                if ( m_pAcceptor != NULL )
+                {
+                    m_pAcceptor->m_uClient = uClient;
+                    m_Ready.push_back( m_pAcceptor->m_Handle );
+                    m_pAcceptor = NULL;
+                }
+                else
+                {
+                    m_Accepted.push_back( uClient );
+                }
+                return;
+            }
+
+            Peer& peer = m_Peers[uClient];
+            if ( pMsg->Type == TNMessage_Disconnect )
+            {
+                m_pNode->DeleteReceivedText( pMsg );
+                peer.bClosed = true;
+                ReadAwaiter* pReader = peer.pReader;
+                if ( pReader != NULL )
+                    Complete( pReader, NULL );
+                if ( peer.Messages.empty() )
+                    m_Peers.erase( uClient ); // an unknown client reads as closed
+                return;
+            }
+
+            ReadAwaiter* pReader = peer.pReader;
+            if ( pReader != NULL && pReader->m_bLinesOnly && pMsg->IsFrame() )
+                m_pNode->DeleteReceivedText( pMsg );
+            else if ( pReader != NULL )
+                Complete( pReader, pMsg );
+            else
+                peer.Messages.push_back( pMsg );
+        }
+
+    void Complete( ReadAwaiter* pReader, TNMessagePtr pMsg )
+        {
+            RemoveReader( pReader );
+            m_Timers.Remove( &pReader->m_Timer );
+            pReader->m_pMsg = pMsg;
+            m_Ready.push_back( pReader->m_Handle );
+        }
+
+    // Fast path of ReadAwaiter: true if it can complete without suspending.
+    bool Take( ReadAwaiter* pReader )
+        {
+            PeerMap::iterator it = m_Peers.find( pReader->m_uClient );
+            if ( it == m_Peers.end() )
+                return true; // gone
+
+            Peer& peer = (*it).second;
+            while ( !peer.Messages.empty() )
+            {
+                TNMessagePtr pMsg = peer.Messages.front();
+                peer.Messages.pop_front();
+                if ( pReader->m_bLinesOnly && pMsg->IsFrame() )
+                {
+                    m_pNode->DeleteReceivedText( pMsg );
+                    continue;
+                }
+
+                pReader->m_pMsg = pMsg;
+                return true;
+            }
+
+            if ( peer.bClosed )
+            {
+                m_Peers.erase( it );
+                return true;
+            }
+
+            return false;
+        }
+
+    void AddReader( ReadAwaiter* pReader )
+        {
+            Peer& peer = m_Peers[pReader->m_uClient];
+            assert( peer.pReader == NULL ); // one reader per session
+            peer.pReader = pReader;
+        }
+
+    void RemoveReader( ReadAwaiter* pReader )
+        {
+            PeerMap::iterator it = m_Peers.find( pReader->m_uClient );
+            if ( it != m_Peers.end() && (*it).second.pReader == pReader )
+                (*it).second.pReader = NULL;
+        }
+
+    void Finished( std::coroutine_handle<> task )
+        { m_Tasks.erase( task ); }
+
+    TelnetNode*                         m_pNode;
+    TNTimerWheel                        m_Timers;
+    std::deque<std::coroutine_handle<>> m_Ready;
+    std::set<std::coroutine_handle<>>   m_Tasks;
+    PeerMap                             m_Peers;
+    std::deque<unsigned int>            m_Accepted;
+    AcceptAwaiter*                      m_pAcceptor;
+    TNMutex                             m_StopMutex;
+    bool                                m_bStop;
+}; // End : TNEventLoop
+
+
+// TNSession : One peer of the node driven by a TNEventLoop. On a server it
+// comes from Accept, on a client it is TNSession( loop ) for the server.
+class TNSession
+{
+public:
+    explicit TNSession( TNEventLoop& loop, unsigned int uClient = 0 )
+        : m_pLoop(&loop)
+        , m_uClient(uClient)
+        {}
+
+    unsigned int ID() const
+        { return m_uClient; }
+
+    TNEventLoop::ReadAwaiter ReadMessage( unsigned int uTimeoutMs = 0 )
+        { return TNEventLoop::ReadAwaiter( m_pLoop, m_uClient, uTimeoutMs, false ); }
+
+    TNEventLoop::LineAwaiter ReadLine( std::string& line, unsigned int uTimeoutMs = 0 )
+        { return TNEventLoop::LineAwaiter( m_pLoop, m_uClient, uTimeoutMs, line ); }
+
+    // Completes at once with the result of SendText.
+    class SendAwaiter
+    {
+    public:
+        explicit SendAwaiter( bool bResult )
+            : m_bResult(bResult)
+            {}
+
+        bool await_ready() const
+            { return true; }
+
+        void await_suspend( std::coroutine_handle<> /*handle*/ )
+            {}
+
+        bool await_resume() const
+            { return m_bResult; }
+
+    private:
+        bool m_bResult;
+    };
+
+    SendAwaiter Send( const char* pText )
+        { return SendAwaiter( m_pLoop->Node()->SendText(pText, m_uClient) ); }
+
+    SendAwaiter Send( const std::string& text )
+        { return Send( text.c_str() ); }
+
+    void Disconnect()
+        { m_pLoop->Node()->Disconnect( m_uClient ); }
+
+private:
+    TNEventLoop* m_pLoop;
+    unsigned int m_uClient;
+}; // End : TNSession
+
+
+inline TNSession TNEventLoop::AcceptAwaiter::await_resume()
+{
+    return TNSession( *m_pLoop, m_uClient );
+}
+
+template <typename T>
+inline std::coroutine_handle<> TNTask<T>::promise_type::FinalAwaiter::await_suspend( std::coroutine_handle<promise_type> handle ) noexcept
+{
+    promise_type& promise = handle.promise();
+    if ( promise.pLoop != NULL )
+    {
+        // spawned: nobody holds a TNTask, so the frame frees itself
+        promise.pLoop->Finished( handle );
+        handle.destroy();
+        return std::noop_coroutine();
+    }
+
+    if ( promise.Continuation )
+        return promise.Continuation;
+
+    return std::noop_coroutine();
+}
+
+#endif // defined(__cpp_impl_coroutine)
+
+#endif // TNEVENTLOOP_H_INCLUDED
@@ -0,0 +1,1756 @@
+// -*- mode: C++; coding: utf-8-unix -*-
+#include "TelnetNodeImpl.h"
+
+
+// TNThread
+
+struct TNThread::StartInfo
+{
+    EntryFunc   pfnFunc;
+    void*       pArg;
+    std::string Name;
+    TNCpuSet    Cpus;
+    int         iPolicy; // applied by the thread itself; -1: none
+};
+
+bool TNThread::Run( EntryFunc pfnFunc, void* pArg, const TNThreadAttributes& attr )
+{
+    bool result = true;
+
+    StartInfo* pInfo = new StartInfo; // deleted by StartEntry
+    pInfo->pfnFunc = pfnFunc;
+    pInfo->pArg    = pArg;
+    pInfo->Name    = attr.Name;
+    pInfo->Cpus    = attr.Cpus;
+    pInfo->iPolicy = -1;
+
+#if defined(TNPLATFORM_UNIX)
+    pthread_attr_t threadAttr;
+    pthread_attr_init( &threadAttr );
+    if ( attr.uStackSize > 0 && pthread_attr_setstacksize(&threadAttr, attr.uStackSize) != 0 )
+        result = false;
+
+    bool scheduled = false;
+    if ( attr.Policy != TNSched_Default )
+    {
+        int policy = SCHED_OTHER;
+        sched_param param = { 0 };
+        switch ( attr.Policy )
+        {
+#  if defined(SCHED_BATCH) && defined(SCHED_IDLE)
+        // not accepted by pthread_attr_setschedpolicy
+        case TNSched_Batch:      pInfo->iPolicy = SCHED_BATCH; break;
+        case TNSched_Idle:       pInfo->iPolicy = SCHED_IDLE; break;
+#  endif
+        case TNSched_Fifo:       policy = SCHED_FIFO; param.sched_priority = attr.iPriority; break;
+        case TNSched_RoundRobin: policy = SCHED_RR; param.sched_priority = attr.iPriority; break;
+        default:                 break;
+        }
+
+        scheduled = pInfo->iPolicy < 0
+                 && pthread_attr_setschedpolicy( &threadAttr, policy ) == 0
+                 && pthread_attr_setschedparam( &threadAttr, &param ) == 0
+                 && pthread_attr_setinheritsched( &threadAttr, PTHREAD_EXPLICIT_SCHED ) == 0;
+        if ( !scheduled )
+        {
+            pthread_attr_setinheritsched( &threadAttr, PTHREAD_INHERIT_SCHED );
+            result = result && pInfo->iPolicy >= 0;
+        }
+    }
+
+    int error = pthread_create( &m_hThread, &threadAttr, StartEntry, pInfo );
+    if ( error != 0 && scheduled )
+    {
+        // typically EPERM for the real-time policies without privileges
+        pthread_attr_setinheritsched( &threadAttr, PTHREAD_INHERIT_SCHED );
+        error = pthread_create( &m_hThread, &threadAttr, StartEntry, pInfo );
+        result = false;
+    }
+    pthread_attr_destroy( &threadAttr );
+
+    if ( error != 0 )
+    {
+        delete pInfo;
+        Invalidate();
+        result = false;
+    }
+#elif defined(TNPLATFORM_WINDOWS)
+    m_hThread = ::CreateThread( 0, attr.uStackSize, StartEntry, pInfo,
+                                attr.uStackSize > 0 ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0, 0 );
+    if ( m_hThread == NULL )
+    {
+        delete pInfo;
+        result = false;
+    }
+    else if ( attr.Policy != TNSched_Default )
+    {
+        int priority = THREAD_PRIORITY_NORMAL;
+        switch ( attr.Policy )
+        {
+        case TNSched_Batch:      priority = THREAD_PRIORITY_BELOW_NORMAL; break;
+        case TNSched_Idle:       priority = THREAD_PRIORITY_IDLE; break;
+        case TNSched_Fifo:       priority = THREAD_PRIORITY_TIME_CRITICAL; break;
+        case TNSched_RoundRobin: priority = THREAD_PRIORITY_HIGHEST; break;
+        default:                 break;
+        }
+        if ( !::SetThreadPriority(m_hThread, priority) )
+            result = false;
+    }
+#endif
+
+    return result;
+}
+
+// static
+TNThread::RetVal TNAPI TNThread::StartEntry( void* arg )
+{
+    StartInfo* pInfo = (StartInfo*)arg;
+    if ( !pInfo->Name.empty() )
+        SetName( pInfo->Name.c_str() );
+    if ( !pInfo->Cpus.empty() )
+        SetAffinity( pInfo->Cpus );
+#if defined(TNPLATFORM_UNIX)
+    if ( pInfo->iPolicy >= 0 )
+    {
+        sched_param param = { 0 };
+        pthread_setschedparam( pthread_self(), pInfo->iPolicy, &param );
+    }
+#endif
+
+    EntryFunc pfnFunc = pInfo->pfnFunc;
+    void* pArg = pInfo->pArg;
+    delete pInfo; // pfnFunc may end the thread without returning
+
+    return pfnFunc( pArg );
+}
+
+// static
+bool TNThread::SetAffinity( const TNCpuSet& cpus )
+{
+#if defined(__linux__)
+    cpu_set_t mask;
+    CPU_ZERO( &mask );
+    for ( std::size_t i = 0; i < cpus.size(); ++i )
+    {
+        if ( cpus[i] < CPU_SETSIZE )
+            CPU_SET( cpus[i], &mask );
+    }
+    return pthread_setaffinity_np( pthread_self(), sizeof(mask), &mask ) == 0;
+#elif defined(TNPLATFORM_WINDOWS)
+    DWORD_PTR mask = 0;
+    for ( std::size_t i = 0; i < cpus.size(); ++i )
+    {
+        if ( cpus[i] < sizeof(mask) * 8 )
+            mask |= (DWORD_PTR)1 << cpus[i];
+    }
+    return mask != 0 && ::SetThreadAffinityMask( ::GetCurrentThread(), mask ) != 0;
+#else
+    return cpus.empty();
+#endif
+}
+
+// static
+void TNThread::SetName( const char* pName )
+{
+#if defined(__linux__)
+    char name[16]; // the kernel limit, '\0' included
+    std::strncpy( name, pName, sizeof(name) - 1 );
+    name[sizeof(name) - 1] = '\0';
+    pthread_setname_np( pthread_self(), name );
+#elif defined(__APPLE__)
+    pthread_setname_np( pName );
+#elif defined(TNPLATFORM_WINDOWS)
+    // SetThreadDescription exists from Windows 10 1607 on
+    typedef HRESULT (WINAPI *SetThreadDescriptionFunc)( HANDLE, PCWSTR );
+    SetThreadDescriptionFunc pfnSetDescription = (SetThreadDescriptionFunc)
+        ::GetProcAddress( ::GetModuleHandleA("kernel32.dll"), "SetThreadDescription" );
+    if ( pfnSetDescription != NULL )
+    {
+        WCHAR name[64];
+        if ( ::MultiByteToWideChar(CP_UTF8, 0, pName, -1, name, 64) == 0 )
+            name[63] = L'\0';
+        pfnSetDescription( ::GetCurrentThread(), name );
+    }
+#else
+    (void)pName;
+#endif
+}
+
+
+// TNTopology
+
+#if defined(__linux__)
+// Parses a sysfs CPU/node list such as "0-3,8-11".
+static TNCpuSet ParseCpuList( const char* pPath )
+{
+    TNCpuSet result;
+
+    FILE* pFile = std::fopen( pPath, "r" );
+    if ( pFile == NULL )
+        return result;
+
+    char line[4096];
+    if ( std::fgets(line, sizeof(line), pFile) != NULL )
+    {
+        const char* p = line;
+        while ( *p >= '0' && *p <= '9' )
+        {
+            char* pEnd = NULL;
+            unsigned long first = std::strtoul( p, &pEnd, 10 );
+            unsigned long last = first;
+            if ( *pEnd == '-' )
+                last = std::strtoul( pEnd + 1, &pEnd, 10 );
+            for ( unsigned long cpu = first; cpu <= last; ++cpu )
+                result.push_back( (unsigned int)cpu );
+
+            p = (*pEnd == ',') ? pEnd + 1 : pEnd;
+        }
+    }
+    std::fclose( pFile );
+
+    return result;
+}
+#endif
+
+// static
+TNCpuSet TNTopology::AllowedCpus()
+{
+    TNCpuSet result;
+
+#if defined(__linux__)
+    cpu_set_t mask;
+    CPU_ZERO( &mask );
+    if ( sched_getaffinity(0, sizeof(mask), &mask) == 0 )
+    {
+        for ( unsigned int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+        {
+            if ( CPU_ISSET(cpu, &mask) )
+                result.push_back( cpu );
+        }
+    }
+#elif defined(TNPLATFORM_WINDOWS)
+    DWORD_PTR processMask = 0;
+    DWORD_PTR systemMask = 0;
+    if ( ::GetProcessAffinityMask(::GetCurrentProcess(), &processMask, &systemMask) )
+    {
+        for ( unsigned int cpu = 0; cpu < sizeof(processMask) * 8; ++cpu )
+        {
+            if ( processMask & ((DWORD_PTR)1 << cpu) )
+                result.push_back( cpu );
+        }
+    }
+#endif
+
+#if defined(TNPLATFORM_UNIX)
+    if ( result.empty() )
+    {
+        long count = sysconf( _SC_NPROCESSORS_ONLN );
+        for ( long cpu = 0; cpu < count; ++cpu )
+            result.push_back( (unsigned int)cpu );
+    }
+#endif
+
+    return result;
+}
+
+// static
+TNCpuSetList TNTopology::Nodes()
+{
+    TNCpuSetList result;
+
+#if defined(__linux__)
+    TNCpuSet nodes = ParseCpuList( "/sys/devices/system/node/online" );
+    for ( std::size_t i = 0; i < nodes.size(); ++i )
+    {
+        char path[64];
+        std::sprintf( path, "/sys/devices/system/node/node%u/cpulist", nodes[i] );
+        TNCpuSet cpus = ParseCpuList( path );
+        if ( !cpus.empty() )
+            result.push_back( cpus );
+    }
+#elif defined(TNPLATFORM_WINDOWS)
+    ULONG highest = 0;
+    if ( ::GetNumaHighestNodeNumber(&highest) )
+    {
+        for ( ULONG node = 0; node <= highest; ++node )
+        {
+            ULONGLONG mask = 0;
+            if ( !::GetNumaNodeProcessorMask((UCHAR)node, &mask) || mask == 0 )
+                continue;
+
+            TNCpuSet cpus;
+            for ( unsigned int cpu = 0; cpu < 64; ++cpu )
+            {
+                if ( mask & ((ULONGLONG)1 << cpu) )
+                    cpus.push_back( cpu );
+            }
+            result.push_back( cpus );
+        }
+    }
+#endif
+
+    if ( result.empty() )
+        result.push_back( AllowedCpus() );
+
+    return result;
+}
+
+
+// TelnetNode
+
+#if defined(TNPLATFORM_UNIX)
+#  define TN_THREAD_LOCAL __thread
+#elif defined(TNPLATFORM_WINDOWS)
+#  define TN_THREAD_LOCAL __declspec(thread)
+#endif
+
+// TNOpenBatch : A batch the calling thread has open on one node, with the
+// clients whose text it holds back.
+struct TNOpenBatch
+{
+    TelnetNode*            pNode;
+    unsigned int           uDepth;
+    std::set<unsigned int> Clients;
+    TNOpenBatch*           pNext;
+};
+
+static TNOpenBatch*& OpenBatches()
+{
+    static TN_THREAD_LOCAL TNOpenBatch* pBatches = NULL;
+    return pBatches;
+}
+
+static TNOpenBatch* FindOpenBatch( TelnetNode* pNode )
+{
+    TNOpenBatch* pBatch = OpenBatches();
+    while ( pBatch != NULL && pBatch->pNode != pNode )
+        pBatch = pBatch->pNext;
+
+    return pBatch;
+}
+
+void TelnetNode::BeginBatch()
+{
+    TNOpenBatch* pBatch = FindOpenBatch( this );
+    if ( pBatch == NULL )
+    {
+        pBatch = new TNOpenBatch; // deleted when the outermost batch ends
+        pBatch->pNode  = this;
+        pBatch->uDepth = 0;
+        pBatch->pNext  = OpenBatches();
+        OpenBatches() = pBatch;
+    }
+    ++pBatch->uDepth;
+}
+
+void TelnetNode::EndBatch()
+{
+    TNOpenBatch* pBatch = FindOpenBatch( this );
+    if ( pBatch == NULL || --pBatch->uDepth > 0 )
+        return;
+
+    TNOpenBatch** ppLink = &OpenBatches();
+    while ( *ppLink != pBatch )
+        ppLink = &(*ppLink)->pNext;
+    *ppLink = pBatch->pNext;
+
+    for ( std::set<unsigned int>::iterator it = pBatch->Clients.begin(); it != pBatch->Clients.end(); ++it )
+        Flush( *it );
+    delete pBatch;
+}
+
+bool TelnetNode::IsBatching()
+{
+    return FindOpenBatch( this ) != NULL;
+}
+
+bool TelnetNode::HoldBack( unsigned int uClient )
+{
+    TNOpenBatch* pBatch = FindOpenBatch( this );
+    if ( pBatch == NULL )
+        return false;
+
+    pBatch->Clients.insert( uClient );
+    return true;
+}
+
+TNWriter TelnetNode::Writer( unsigned int uClient )
+{
+    return TNWriter( this, uClient );
+}
+
+void TelnetNode::PushReceivedText( TNTextPtr pText, unsigned int uClient )
+{
+    PushReceivedMessage( new TNMessage(pText, uClient) );
+}
+
+void TelnetNode::PushReceivedMessage( TNMessagePtr pMsg )
+{
+    if ( !m_MessageMutex.TryLock() )
+    {
+        TN_TRACE_SCOPE( "message lock", pMsg->ID ); // contended only
+        m_MessageMutex.Lock();
+    }
+    m_Messages.push( pMsg ); // deleted at DeleteReceivedText
+    bool wake = m_bReceiverWaiting;
+    m_MessageMutex.Unlock();
+
+    if ( wake )
+        m_MessageEvent.Set();
+}
+
+bool TelnetNode::WaitReceivedText( unsigned int uTimeoutMs )
+{
+    m_MessageMutex.Lock();
+    bool ready = !m_Messages.empty();
+    m_bReceiverWaiting = !ready;
+    m_MessageMutex.Unlock();
+
+    if ( !ready )
+        m_MessageEvent.Wait( uTimeoutMs );
+
+    m_MessageMutex.Lock();
+    m_bReceiverWaiting = false;
+    ready = !m_Messages.empty();
+    m_MessageMutex.Unlock();
+
+    return ready;
+}
+
+void TelnetNode::SetConnectionEvents( bool bEnable )
+{
+    m_ConfigMutex.Lock();
+    m_bConnectionEvents = bEnable;
+    m_ConfigMutex.Unlock();
+}
+
+bool TelnetNode::IsConnectionEventsEnabled()
+{
+    m_ConfigMutex.Lock();
+    bool result = m_bConnectionEvents;
+    m_ConfigMutex.Unlock();
+
+    return result;
+}
+
+void TelnetNode::PushConnectionEvent( TNMessageType type, unsigned int uClient )
+{
+    if ( IsConnectionEventsEnabled() )
+        PushReceivedMessage( new TNMessage(type, uClient) );
+}
+
+TNMessagePtr TelnetNode::PopReceivedText()
+{
+    TNMessagePtr result = NULL;
+    if ( !m_MessageMutex.TryLock() )
+    {
+        TN_TRACE_SCOPE( "message lock", 0 ); // contended only
+        m_MessageMutex.Lock();
+    }
+    if ( !m_Messages.empty() )
+    {
+        result = m_Messages.front();
+        m_Messages.pop();
+    }
+    m_MessageMutex.Unlock();
+
+    return result;
+}
+
+void TelnetNode::SetTimeouts( const TNTimeoutConfig& config )
+{
+    m_ConfigMutex.Lock();
+    m_Timeouts = config;
+    m_ConfigMutex.Unlock();
+}
+
+TNTimeoutConfig TelnetNode::GetTimeouts()
+{
+    m_ConfigMutex.Lock();
+    TNTimeoutConfig result = m_Timeouts;
+    m_ConfigMutex.Unlock();
+
+    return result;
+}
+
+void TelnetNode::SetReceiveConfig( const TNReceiveConfig& config )
+{
+    m_ConfigMutex.Lock();
+    m_Receive = config;
+    m_ConfigMutex.Unlock();
+}
+
+TNReceiveConfig TelnetNode::GetReceiveConfig()
+{
+    m_ConfigMutex.Lock();
+    TNReceiveConfig result = m_Receive;
+    m_ConfigMutex.Unlock();
+
+    return result;
+}
+
+void TelnetNode::SetThreadConfig( const TNThreadConfig& config )
+{
+    TNCpuSet cpus = config.Cpus.empty() ? TNTopology::AllowedCpus() : config.Cpus;
+    std::sort( cpus.begin(), cpus.end() );
+
+    TNCpuSetList placement;
+    if ( config.Placement == TNPlacement_Core )
+    {
+        for ( std::size_t i = 0; i < cpus.size(); ++i )
+            placement.push_back( TNCpuSet(1, cpus[i]) );
+    }
+    else if ( config.Placement == TNPlacement_Node )
+    {
+        TNCpuSetList nodes = TNTopology::Nodes();
+        for ( std::size_t i = 0; i < nodes.size(); ++i )
+        {
+            TNCpuSet usable;
+            for ( std::size_t j = 0; j < nodes[i].size(); ++j )
+            {
+                if ( std::binary_search(cpus.begin(), cpus.end(), nodes[i][j]) )
+                    usable.push_back( nodes[i][j] );
+            }
+            if ( !usable.empty() )
+                placement.push_back( usable );
+        }
+    }
+
+    m_ConfigMutex.Lock();
+    m_ThreadConfig = config;
+    m_Placement.swap( placement );
+    m_ConfigMutex.Unlock();
+}
+
+TNThreadConfig TelnetNode::GetThreadConfig()
+{
+    m_ConfigMutex.Lock();
+    TNThreadConfig result = m_ThreadConfig;
+    m_ConfigMutex.Unlock();
+
+    return result;
+}
+
+TNCpuSet TelnetNode::GetPlacement( unsigned int uClient )
+{
+    TNCpuSet result;
+
+    m_ConfigMutex.Lock();
+    if ( !m_Placement.empty() )
+        result = m_Placement[((uClient > 0) ? uClient - 1 : 0) % m_Placement.size()]; // IDs start at 1
+    m_ConfigMutex.Unlock();
+
+    return result;
+}
+
+TNThreadAttributes TelnetNode::ReceiveThreadAttributes( unsigned int uClient )
+{
+    TNThreadAttributes result;
+
+    char name[16];
+    std::sprintf( name, "tn-recv-%u", uClient % 10000000 );
+    result.Name = name;
+    result.Cpus = GetPlacement( uClient );
+
+    m_ConfigMutex.Lock();
+    result.uStackSize = m_ThreadConfig.uStackSize;
+    result.Policy     = m_ThreadConfig.Policy;
+    result.iPriority  = m_ThreadConfig.iPriority;
+    m_ConfigMutex.Unlock();
+
+    return result;
+}
+
+bool TelnetNode::SetCompression( bool bEnable )
+{
+#if defined(TN_ENABLE_MCCP)
+    m_ConfigMutex.Lock();
+    m_bCompression = bEnable;
+    m_ConfigMutex.Unlock();
+
+    return true;
+#else
+    return !bEnable;
+#endif
+}
+
+bool TelnetNode::IsCompressionEnabled()
+{
+    m_ConfigMutex.Lock();
+    bool result = m_bCompression;
+    m_ConfigMutex.Unlock();
+
+    return result;
+}
+
+bool TelnetNode::SetTls( bool bEnable, const TNTlsConfig& config )
+{
+#if defined(TN_ENABLE_TLS)
+    return m_pTls->Configure( bEnable, config, IsServer() );
+#else
+    (void)config;
+    return !bEnable;
+#endif
+}
+
+bool TelnetNode::IsTlsEnabled()
+{
+#if defined(TN_ENABLE_TLS)
+    return m_pTls->IsEnabled();
+#else
+    return false;
+#endif
+}
+
+TNTlsStats TelnetNode::GetTlsStats()
+{
+#if defined(TN_ENABLE_TLS)
+    return m_pTls->Stats();
+#else
+    return TNTlsStats();
+#endif
+}
+
+void TelnetNode::ArmTimer( TNTimer* pTimer, unsigned int uDelayMs )
+{
+    m_TimerMutex.Lock();
+    unsigned long long nowMs = TNClock::NowMs();
+    unsigned long long now = nowMs / m_Timers.TickMs();
+    if ( m_Timers.Empty() && now > m_Timers.Current() )
+        m_Timers.Reset( now );
+    // A tick fires as soon as the clock enters it, so the delay counts from
+    // the next tick boundary; counting from 'now' would cut it short.
+    unsigned long long start = (nowMs + m_Timers.TickMs() - 1) / m_Timers.TickMs();
+    m_Timers.Add( pTimer, start + m_Timers.ToTicks(uDelayMs) );
+
+    if ( !m_bTimerRunning )
+    {
+        m_bTimerRunning = true;
+        m_uTimerWake = ~0ULL;
+        TNThreadAttributes attr;
+        attr.Name = "tn-timer";
+        m_TimerThread.Run( TimerThreadEntry, this, attr );
+    }
+    else if ( pTimer->uExpire < m_uTimerWake )
+    {
+        m_TimerEvent.Set(); // due before the timer thread would wake up
+    }
+    m_TimerMutex.Unlock();
+}
+
+void TelnetNode::DisarmTimer( TNTimer* pTimer )
+{
+    m_TimerMutex.Lock();
+    m_Timers.Remove( pTimer );
+    m_TimerMutex.Unlock();
+}
+
+TelnetNode::TelnetNode()
+    : m_MessageMutex()
+    , m_Messages()
+    , m_MessageEvent()
+    , m_bReceiverWaiting(false)
+    , m_TimerMutex()
+    , m_Timers()
+    , m_TimerThread()
+    , m_bTimerRunning(false)
+    , m_TimerEvent()
+    , m_uTimerWake(~0ULL)
+    , m_ConfigMutex()
+    , m_Timeouts()
+    , m_Receive()
+    , m_ThreadConfig()
+    , m_Placement()
+    , m_bCompression(false)
+    , m_bConnectionEvents(false)
+#if defined(TN_ENABLE_MCCP)
+    , m_pCompressors(new TNCompressorPool)
+#else
+    , m_pCompressors(NULL)
+#endif
+#if defined(TN_ENABLE_TLS)
+    , m_pTls(new TNTlsContext)
+#else
+    , m_pTls(NULL)
+#endif
+{}
+
+TelnetNode::~TelnetNode()
+{
+    StopTimers();
+#if defined(TN_ENABLE_MCCP)
+    delete m_pCompressors; // connections are gone by now
+#endif
+#if defined(TN_ENABLE_TLS)
+    delete m_pTls;
+#endif
+}
+
+void TelnetNode::StopTimers()
+{
+    m_TimerMutex.Lock();
+    bool running = m_bTimerRunning;
+    m_bTimerRunning = false;
+    m_TimerMutex.Unlock();
+
+    if ( running )
+    {
+        m_TimerEvent.Set();
+        m_TimerThread.Join();
+    }
+}
+
+// static
+TNThread::RetVal TNAPI TelnetNode::TimerThreadEntry( void* arg )
+{
+    ((TelnetNode*)arg)->TimerThread();
+    TN_TRACE_THREAD_EXIT();
+    TNThread::Exit();
+
+    return 0;
+}
+
+// Sleeps until the next occupied slot of the wheel, or until a timer is armed
+// while it is empty, rather than waking up on every tick.
+void TelnetNode::TimerThread()
+{
+    unsigned int tickMs = m_Timers.TickMs();
+
+    m_TimerMutex.Lock();
+    while ( m_bTimerRunning )
+    {
+        m_Timers.Advance( TNClock::NowMs() / tickMs );
+
+        unsigned int waitMs = TNEvent::Infinite;
+        m_uTimerWake = ~0ULL;
+        if ( !m_Timers.Empty() )
+        {
+            m_uTimerWake = m_Timers.NextTick();
+            unsigned long long wakeMs = m_uTimerWake * tickMs;
+            unsigned long long nowMs  = TNClock::NowMs();
+            waitMs = 0;
+            if ( wakeMs > nowMs )
+                waitMs = (wakeMs - nowMs < TNEvent::Infinite) ? (unsigned int)(wakeMs - nowMs) : TNEvent::Infinite - 1;
+        }
+        m_TimerMutex.Unlock();
+
+        if ( waitMs > 0 )
+            m_TimerEvent.Wait( waitMs );
+
+        m_TimerMutex.Lock();
+    }
+    m_TimerMutex.Unlock();
+}
+
+
+// TNWriter
+
+TNWriter::TNWriter( TelnetNode* pNode, unsigned int uClient )
+    : m_pNode(pNode)
+    , m_uClient(uClient)
+    , m_pConnection(pNode->AcquireConnection( uClient ))
+    , m_pBuffer(&m_Scratch)
+    , m_Scratch()
+{
+    if ( m_pConnection != NULL )
+        m_pBuffer = m_pConnection->AcquireFormatBuffer();
+}
+
+TNWriter::TNWriter( const TNWriter& other )
+    : m_pNode(other.m_pNode)
+    , m_uClient(other.m_uClient)
+    , m_pConnection(other.m_pConnection)
+    , m_pBuffer(other.m_pBuffer)
+    , m_Scratch()
+{
+    m_Scratch.swap( other.m_Scratch );
+    if ( m_pBuffer == &other.m_Scratch )
+        m_pBuffer = &m_Scratch;
+
+    other.m_pConnection = NULL;
+    other.m_pBuffer = NULL;
+}
+
+TNWriter::~TNWriter()
+{
+    if ( m_pBuffer != NULL )
+        Finish( false );
+}
+
+bool TNWriter::Commit()
+{
+    assert( m_pBuffer != NULL );
+    return Finish( true );
+}
+
+bool TNWriter::Finish( bool bReopen )
+{
+    bool result = false;
+
+    if ( m_pConnection != NULL )
+    {
+        // the send lock is taken here only, never while formatting
+        result = m_pBuffer->empty() || m_pConnection->WriteBuffer( *m_pBuffer, !m_pNode->HoldBack( m_pConnection->ID() ) );
+        if ( !bReopen )
+        {
+            m_pConnection->ReleaseFormatBuffer( m_pBuffer );
+            m_pConnection->Release();
+            m_pConnection = NULL;
+            m_pBuffer = NULL;
+        }
+    }
+    else
+    {
+        // Client 0 of a server: everyone gets the text. Otherwise the client
+        // is unknown and the text is dropped.
+        if ( m_uClient == 0 && m_pNode->IsServer() )
+        {
+            result = true;
+            if ( !m_Scratch.empty() )
+            {
+                m_Scratch.push_back( '\0' );
+                result = m_pNode->SendText( &m_Scratch[0], 0 );
+            }
+        }
+        m_Scratch.clear();
+        if ( !bReopen )
+            m_pBuffer = NULL;
+    }
+
+    return result;
+}
+
+
+// Transports
+
+// Servers listening on inproc:// names
+struct TNInprocRegistry
+{
+    TNMutex                              Mutex;
+    std::map<std::string, TelnetServer*> Servers;
+};
+
+static TNInprocRegistry& GetInprocRegistry()
+{
+    static TNInprocRegistry registry; // lives until the process ends
+    return registry;
+}
+
+// Sets the IPv4 address of a host name or dotted address.
+static bool ResolveAddress( const char* address, sockaddr_in& service )
+{
+    service.sin_addr.s_addr = inet_addr( address );
+    if ( service.sin_addr.s_addr == INADDR_NONE )
+    {
+        hostent* pHost = gethostbyname( address );
+        if ( pHost == NULL )
+            return false;
+
+        std::memcpy( &service.sin_addr.s_addr, pHost->h_addr, pHost->h_length );
+        service.sin_family = pHost->h_addrtype;
+    }
+
+    return true;
+}
+
+#if defined(TNPLATFORM_UNIX)
+static bool MakeUnixAddress( const std::string& path, sockaddr_un& service )
+{
+    std::memset( &service, 0, sizeof(service) );
+    service.sun_family = AF_UNIX;
+    if ( path.size() >= sizeof(service.sun_path) )
+        return false;
+
+    std::memcpy( service.sun_path, path.c_str(), path.size() );
+    return true;
+}
+#endif
+
+// Two connected stream sockets.
+static bool CreateSocketPair( TNSocketHandle ends[2] )
+{
+#if defined(TNPLATFORM_UNIX)
+    return socketpair( AF_UNIX, SOCK_STREAM, 0, ends ) == 0;
+#elif defined(TNPLATFORM_WINDOWS)
+    // no socketpair: connect two sockets over the loopback interface
+    sockaddr_in address = { 0 };
+    address.sin_family      = AF_INET;
+    address.sin_port        = 0;
+    address.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    int addressSize = sizeof(address);
+
+    TNSocketHandle listener = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    bool result = listener != TNSocketHandle_Invalid
+               && bind( listener, (sockaddr*)&address, sizeof(address) ) == 0
+               && listen( listener, 1 ) == 0
+               && getsockname( listener, (sockaddr*)&address, &addressSize ) == 0;
+
+    ends[0] = result ? socket( AF_INET, SOCK_STREAM, IPPROTO_TCP ) : TNSocketHandle_Invalid;
+    result = result && ends[0] != TNSocketHandle_Invalid
+          && connect( ends[0], (sockaddr*)&address, sizeof(address) ) == 0;
+    ends[1] = result ? accept( listener, NULL, NULL ) : TNSocketHandle_Invalid;
+    result = result && ends[1] != TNSocketHandle_Invalid;
+
+    if ( !result && ends[0] != TNSocketHandle_Invalid )
+        closesocket( ends[0] );
+    if ( listener != TNSocketHandle_Invalid )
+        closesocket( listener );
+
+    return result;
+#endif
+}
+
+// Connects to the server of this process listening on inproc://name.
+// Returns the client's end of the connection.
+static TNSocketHandle ConnectInproc( const std::string& name )
+{
+    TNSocketHandle ends[2];
+    if ( !CreateSocketPair( ends ) )
+        return TNSocketHandle_Invalid;
+
+    TNInprocRegistry& registry = GetInprocRegistry();
+    registry.Mutex.Lock();
+    std::map<std::string, TelnetServer*>::iterator it = registry.Servers.find( name );
+    bool found = (it != registry.Servers.end());
+    if ( found )
+        (*it).second->Accept( ends[1] ); // the server cannot stop listening meanwhile
+    registry.Mutex.Unlock();
+
+    if ( !found )
+    {
+        closesocket( ends[0] );
+        closesocket( ends[1] );
+        return TNSocketHandle_Invalid;
+    }
+
+    return ends[0];
+}
+
+
+// TelnetClient
+
+TelnetClient::TelnetClient()
+    : m_pServer()
+{}
+
+TelnetClient::~TelnetClient()
+{
+    Close();
+}
+
+bool TelnetClient::SendText( const char* pText, unsigned int /*uClient*/ )
+{
+    std::size_t length = std::strlen( pText );
+    bool result = (m_pServer != NULL) && m_pServer->Write( pText, length, !HoldBack( m_pServer->ID() ) );
+
+    return result;
+}
+
+bool TelnetClient::Flush( unsigned int /*uClient*/ )
+{
+    return (m_pServer != NULL) && m_pServer->Flush();
+}
+
+bool TelnetClient::SendFrame( unsigned short uTag, const void* pData, std::size_t uSize, unsigned int /*uClient*/ )
+{
+    return (m_pServer != NULL) && m_pServer->WriteFrame( uTag, pData, uSize, !HoldBack( m_pServer->ID() ) );
+}
+
+void TelnetClient::Disconnect( unsigned int /*uClient*/ )
+{
+    if ( m_pServer != NULL )
+        m_pServer->Wake();
+}
+
+TNConnectionPtr TelnetClient::AcquireConnection( unsigned int /*uClient*/ )
+{
+    if ( m_pServer != NULL )
+        m_pServer->AddRef();
+
+    return m_pServer;
+}
+
+bool TelnetClient::Connect( const char* address, unsigned int port )
+{
+    bool result = false;
+
+    Close();
+
+    TNSocketHandle serverSocket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
+    if ( serverSocket != TNSocketHandle_Invalid )
+    {
+        sockaddr_in service = { 0 };
+
+        service.sin_family = AF_INET;
+        service.sin_port   = htons( port );
+
+        int connectResult = -1;
+        if ( ResolveAddress( address, service ) )
+            connectResult = connect( serverSocket, (sockaddr*)&service, sizeof(service) );
+
+        if ( connectResult == 0 )
+        {
+            result = Attach( serverSocket, address );
+        }
+        else
+        {
+            assert( !"TelnetClient::Connect : connect != 0" );
+            closesocket( serverSocket );
+        }
+    }
+    else
+    {
+        assert( !"TelnetClient::Connect : serverSocket == TNSocketHandle_Invalid" );
+    }
+
+    return result;
+}
+
+bool TelnetClient::ConnectUri( const char* uri )
+{
+    TNUri target = TNUri::Parse( uri );
+    if ( target.Type == TNUri::Scheme_Tcp )
+        return Connect( target.Host.c_str(), target.Port );
+
+    Close();
+
+    TNSocketHandle serverSocket = TNSocketHandle_Invalid;
+#if defined(TNPLATFORM_UNIX)
+    sockaddr_un service;
+    if ( target.Type == TNUri::Scheme_Unix && MakeUnixAddress( target.Path, service ) )
+    {
+        serverSocket = socket( AF_UNIX, SOCK_STREAM, 0 );
+        if ( serverSocket != TNSocketHandle_Invalid && connect( serverSocket, (sockaddr*)&service, sizeof(service) ) != 0 )
+        {
+            closesocket( serverSocket );
+            serverSocket = TNSocketHandle_Invalid;
+        }
+    }
+#endif
+    if ( target.Type == TNUri::Scheme_Inproc )
+        serverSocket = ConnectInproc( target.Path );
+
+    return serverSocket != TNSocketHandle_Invalid && Attach( serverSocket, NULL );
+}
+
+bool TelnetClient::Attach( TNSocketHandle hSocket, const char* pPeerName )
+{
+    TNConnectionPtr pConnection( new TNConnection(this, hSocket, 0) );
+    pConnection->Start( pPeerName );
+    m_pServer = pConnection;
+
+    bool result = pConnection->WaitEstablished();
+    if ( result == false )
+    {
+        Close(); // TLS handshake failed
+    }
+
+    return result;
+}
+
+void TelnetClient::Close()
+{
+    if ( m_pServer != NULL )
+    {
+        m_pServer->Close();
+        m_pServer->Release();
+        m_pServer = NULL;
+    }
+}
+
+
+// TelnetServer
+
+// Progress of one connection through TelnetServer::Shutdown
+struct TNDrainState
+{
+    TNConnectionPtr    pClient;
+    unsigned long long uSentBefore; // bytes sent when the drain started
+    bool               bStarted;    // uSentBefore is known
+    bool               bFlushed;    // nothing buffered by Write is left
+
+    TNDrainState()
+        : pClient(NULL)
+        , uSentBefore(0)
+        , bStarted(false)
+        , bFlushed(false)
+        {}
+};
+
+TelnetServer::TelnetServer()
+    : m_ListenThread()
+    , m_ListenSocket(TNSocketHandle_Invalid)
+    , m_ListenSocketMutex()
+    , m_UnixPath()
+    , m_InprocName()
+    , m_uClientCreatedCount(0)
+    , m_ClientsMutex()
+    , m_Clients()
+    , m_Closed()
+    , m_ReapTimer(ReapTimerCallback, this)
+    , m_TopicMutex()
+    , m_pTopics(new TNTopicTrie)
+{}
+
+TelnetServer::~TelnetServer()
+{
+    Close();
+    delete m_pTopics;
+}
+
+bool TelnetServer::SendText( const char* pText, unsigned int uClient )
+{
+    TNConnectionList targets;
+    AcquireTargets( uClient, targets );
+
+    return WriteAll( targets, pText );
+}
+
+bool TelnetServer::Flush( unsigned int uClient )
+{
+    TNConnectionList targets;
+    AcquireTargets( uClient, targets );
+
+    bool result = true;
+    for ( TNConnectionList::iterator it = targets.begin(); it != targets.end(); ++it )
+    {
+        TNConnectionPtr pClient = *it;
+        bool done = pClient->Flush();
+        if ( !done )
+            result = false;
+        pClient->Release();
+    }
+
+    return result;
+}
+
+bool TelnetServer::SendFrame( unsigned short uTag, const void* pData, std::size_t uSize, unsigned int uClient )
+{
+    TNConnectionList targets;
+    AcquireTargets( uClient, targets );
+
+    bool result = true;
+    for ( TNConnectionList::iterator it = targets.begin(); it != targets.end(); ++it )
+    {
+        TNConnectionPtr pClient = *it;
+        bool done = pClient->WriteFrame( uTag, pData, uSize, !HoldBack( pClient->ID() ) );
+        if ( !done )
+            result = false;
+        pClient->Release();
+    }
+
+    return result;
+}
+
+void TelnetServer::Disconnect( unsigned int uClient )
+{
+    if ( uClient == 0 )
+        return;
+
+    TNConnectionList targets;
+    AcquireTargets( uClient, targets );
+    for ( std::size_t i = 0; i < targets.size(); ++i )
+    {
+        targets[i]->Wake();
+        targets[i]->Release();
+    }
+}
+
+TNConnectionPtr TelnetServer::AcquireConnection( unsigned int uClient )
+{
+    if ( uClient == 0 )
+        return NULL;
+
+    TNConnectionList targets;
+    AcquireTargets( uClient, targets );
+
+    return targets.empty() ? NULL : targets[0];
+}
+
+void TelnetServer::ConnectionClosed( TNConnectionPtr pConnection )
+{
+    unsigned int uClient = pConnection->ID();
+
+    m_ClientsMutex.Lock();
+    TNConnectionMap::iterator it = m_Clients.find( uClient );
+    bool found = (it != m_Clients.end());
+    if ( found )
+    {
+        m_Clients.erase( it );
+        m_Closed.push_back( pConnection );
+    }
+    m_ClientsMutex.Unlock();
+
+    if ( !found )
+        return; // Shutdown has taken it over
+
+    m_TopicMutex.Lock();
+    m_pTopics->RemoveClient( uClient );
+    m_TopicMutex.Unlock();
+
+    ArmTimer( &m_ReapTimer, 0 ); // its thread has nothing left to do but exit
+}
+
+// static
+void TelnetServer::ReapTimerCallback( TNTimerWheel& /*wheel*/, TNTimer* /*pTimer*/, void* arg )
+{
+    TelnetServer* pServer = (TelnetServer*)arg;
+
+    TNConnectionList closed;
+    pServer->m_ClientsMutex.Lock();
+    closed.swap( pServer->m_Closed );
+    pServer->m_ClientsMutex.Unlock();
+
+    for ( TNConnectionList::iterator it = closed.begin(); it != closed.end(); ++it )
+    {
+        (*it)->Close(); // its timers are disarmed already, see TNConnection::Close
+        (*it)->Release();
+    }
+}
+
+bool TelnetServer::Subscribe( unsigned int uClient, const char* pPattern )
+{
+    m_ClientsMutex.Lock();
+    bool known = m_Clients.find( uClient ) != m_Clients.end();
+    m_ClientsMutex.Unlock();
+    if ( !known || pPattern == NULL )
+        return false;
+
+    m_TopicMutex.Lock();
+    bool result = m_pTopics->Subscribe( uClient, pPattern );
+    m_TopicMutex.Unlock();
+
+    return result;
+}
+
+bool TelnetServer::Unsubscribe( unsigned int uClient, const char* pPattern )
+{
+    if ( pPattern == NULL )
+        return false;
+
+    m_TopicMutex.Lock();
+    bool result = m_pTopics->Unsubscribe( uClient, pPattern );
+    m_TopicMutex.Unlock();
+
+    return result;
+}
+
+bool TelnetServer::Publish( const char* pTopic, const char* pText )
+{
+    TNTopicTrie::ClientList subscribers;
+    m_TopicMutex.Lock();
+    subscribers = m_pTopics->Match( pTopic );
+    m_TopicMutex.Unlock();
+
+    TNConnectionList targets;
+    m_ClientsMutex.Lock();
+    targets.reserve( subscribers.size() );
+    for ( TNTopicTrie::ClientList::iterator it = subscribers.begin(); it != subscribers.end(); ++it )
+    {
+        TNConnectionMap::iterator found = m_Clients.find( *it );
+        if ( found != m_Clients.end() )
+        {
+            TNConnectionPtr pClient = (*found).second;
+            pClient->AddRef();
+            targets.push_back( pClient );
+        }
+    }
+    m_ClientsMutex.Unlock();
+
+    return WriteAll( targets, pText );
+}
+
+bool TelnetServer::HandleTopicCommand( TNMessagePtr pMsg )
+{
+    if ( pMsg == NULL || pMsg->Type != TNMessage_Text )
+        return false;
+
+    static const char subscribe[]   = "subscribe ";
+    static const char unsubscribe[] = "unsubscribe ";
+    const char* pPattern = NULL;
+    bool isSubscribe = false;
+    if ( std::strncmp(pMsg->Text, subscribe, sizeof(subscribe) - 1) == 0 )
+    {
+        pPattern = pMsg->Text + sizeof(subscribe) - 1;
+        isSubscribe = true;
+    }
+    else if ( std::strncmp(pMsg->Text, unsubscribe, sizeof(unsubscribe) - 1) == 0 )
+    {
+        pPattern = pMsg->Text + sizeof(unsubscribe) - 1;
+    }
+    else
+    {
+        return false;
+    }
+
+    std::string pattern( pPattern );
+    std::string::size_type end = pattern.find_last_not_of( " \t\r\n" );
+    pattern.erase( end == std::string::npos ? 0 : end + 1 );
+
+    bool done = isSubscribe ? Subscribe( pMsg->ID, pattern.c_str() ) : Unsubscribe( pMsg->ID, pattern.c_str() );
+    SendText( done ? "ok\n" : "error\n", pMsg->ID );
+
+    return true;
+}
+
+TNTrafficStats TelnetServer::GetTrafficStats( unsigned int uClient )
+{
+    TNTrafficStats result;
+    m_ClientsMutex.Lock();
+    for ( TNConnectionMap::iterator it = m_Clients.begin(); it != m_Clients.end(); ++it )
+    {
+        if ( uClient == 0 || (*it).first == uClient )
+        {
+            TNTrafficStats traffic = (*it).second->Traffic();
+            result.uBytesSent += traffic.uBytesSent;
+            result.uSendCalls += traffic.uSendCalls;
+        }
+    }
+    m_ClientsMutex.Unlock();
+
+    return result;
+}
+
+bool TelnetServer::Listen( unsigned int port )
+{
+    Close();
+
+    sockaddr_in service = { 0 };
+
+    service.sin_family      = AF_INET;
+    service.sin_port        = htons( port );
+    service.sin_addr.s_addr = htonl( INADDR_ANY );
+
+    return ListenOn( socket( AF_INET, SOCK_STREAM, IPPROTO_TCP ), &service, sizeof(service) );
+}
+
+bool TelnetServer::ListenUri( const char* uri )
+{
+    bool result = false;
+    TNUri target = TNUri::Parse( uri );
+
+    Close();
+
+    switch ( target.Type )
+    {
+    case TNUri::Scheme_Tcp:
+        {
+            sockaddr_in service = { 0 };
+
+            service.sin_family      = AF_INET;
+            service.sin_port        = htons( target.Port );
+            service.sin_addr.s_addr = htonl( INADDR_ANY );
+
+            if ( target.Host.empty() || target.Host == "*" || ResolveAddress( target.Host.c_str(), service ) )
+                result = ListenOn( socket( AF_INET, SOCK_STREAM, IPPROTO_TCP ), &service, sizeof(service) );
+        }
+        break;
+
+#if defined(TNPLATFORM_UNIX)
+    case TNUri::Scheme_Unix:
+        {
+            sockaddr_un service;
+            if ( !MakeUnixAddress( target.Path, service ) )
+                break;
+
+            // a socket file nobody accepts on is left over from a previous run
+            struct stat info;
+            if ( lstat( target.Path.c_str(), &info ) == 0 && S_ISSOCK(info.st_mode) )
+            {
+                TNSocketHandle probe = socket( AF_UNIX, SOCK_STREAM, 0 );
+                if ( probe != TNSocketHandle_Invalid && connect( probe, (sockaddr*)&service, sizeof(service) ) != 0 )
+                    unlink( target.Path.c_str() );
+                if ( probe != TNSocketHandle_Invalid )
+                    closesocket( probe );
+            }
+
+            result = ListenOn( socket( AF_UNIX, SOCK_STREAM, 0 ), &service, sizeof(service) );
+            if ( result )
+            {
+                m_ListenSocketMutex.Lock();
+                m_UnixPath = target.Path;
+                m_ListenSocketMutex.Unlock();
+            }
+        }
+        break;
+#endif
+
+    case TNUri::Scheme_Inproc:
+        {
+            TNInprocRegistry& registry = GetInprocRegistry();
+            registry.Mutex.Lock();
+            result = registry.Servers.insert( std::make_pair(target.Path, this) ).second;
+            registry.Mutex.Unlock();
+
+            if ( result )
+            {
+                m_ListenSocketMutex.Lock();
+                m_InprocName = target.Path;
+                m_ListenSocketMutex.Unlock();
+            }
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    return result;
+}
+
+bool TelnetServer::ListenOn( TNSocketHandle hSocket, const void* pAddress, unsigned int uAddressSize )
+{
+    bool result = false;
+
+    m_ListenThread.Invalidate();
+
+    m_ListenSocket = hSocket;
+    if ( m_ListenSocket != TNSocketHandle_Invalid )
+    {
+        int bindResult = bind( m_ListenSocket, (const sockaddr*)pAddress, uAddressSize );
+        if ( bindResult == 0 )
+        {
+            int listenResult = listen( m_ListenSocket, SOMAXCONN );
+            if ( listenResult == 0 )
+            {
+                TNThreadAttributes attr;
+                attr.Name = "tn-listen";
+                m_ListenThread.Run( ListenThreadEntry, this, attr );
+            }
+            else
+            {
+                assert( !"TelnetServer::Listen : listen != 0" );
+            }
+        }
+        else
+        {
+            assert( !"TelnetServer::Listen : bind != 0" );
+        }
+
+        if ( !m_ListenThread.IsInvalid() )
+        {
+            result = true;
+        }
+        else
+        {
+            closesocket( m_ListenSocket );
+            m_ListenSocket = TNSocketHandle_Invalid;
+        }
+    }
+    else
+    {
+        assert( !"TelnetServer::Listen : m_ListenSocket == TNSocketHandle_Invalid" );
+    }
+
+    return result;
+}
+
+unsigned int TelnetServer::Accept( TNSocketHandle hSocket )
+{
+    m_ClientsMutex.Lock();
+    unsigned int uClientID = ++m_uClientCreatedCount;
+    TNConnectionPtr pConnection( new TNConnection(this, hSocket, uClientID) );
+    m_Clients[uClientID] = pConnection;
+    m_ClientsMutex.Unlock();
+
+    pConnection->Start();
+    PushConnectionEvent( TNMessage_Connect, uClientID );
+
+    return uClientID;
+}
+
+void TelnetServer::Close()
+{
+    Shutdown( 0 );
+}
+
+TNShutdownStats TelnetServer::Shutdown( unsigned int uDrainMs )
+{
+    TNShutdownStats stats;
+
+    StopListening();
+
+    TNConnectionMap clients;
+    m_ClientsMutex.Lock();
+    clients.swap( m_Clients );
+    TNConnectionList closed;
+    closed.swap( m_Closed );
+    m_ClientsMutex.Unlock();
+    stats.uConnections = clients.size();
+
+    for ( TNConnectionList::iterator it = closed.begin(); it != closed.end(); ++it )
+    {
+        (*it)->Close();
+        (*it)->Release();
+    }
+    DisarmTimer( &m_ReapTimer ); // their threads have armed it for the last time
+
+    m_TopicMutex.Lock();
+    for ( TNConnectionMap::iterator it = clients.begin(); it != clients.end(); ++it )
+        m_pTopics->RemoveClient( (*it).first );
+    m_TopicMutex.Unlock();
+
+    std::vector<TNDrainState> drains( clients.size() );
+    std::vector<TNDrainState>::iterator it = drains.begin();
+    for ( TNConnectionMap::iterator client = clients.begin(); client != clients.end(); ++client, ++it )
+        it->pClient = (*client).second;
+
+    // Hand what SendText has buffered to the kernel, then let the kernel send
+    // its queue, retrying until the deadline. Without uDrainMs there is one
+    // attempt, and the kernel goes on sending after the sockets are closed.
+    unsigned long long deadline = TNClock::NowMs() + uDrainMs;
+    bool done = false;
+    while ( !done )
+    {
+        done = true;
+        for ( it = drains.begin(); it != drains.end(); ++it )
+        {
+            if ( !it->bStarted )
+                it->bStarted = it->pClient->TryBytesSent( it->uSentBefore );
+            if ( it->bStarted && !it->bFlushed )
+            {
+                it->bFlushed = it->pClient->FlushNonBlocking( stats.uBytesDropped );
+                if ( it->bFlushed && uDrainMs > 0 )
+                    it->pClient->BeginDrain();
+            }
+
+            if ( !it->bFlushed || (uDrainMs > 0 && it->pClient->IsReceiving() && it->pClient->UnsentBytes() > 0) )
+                done = false;
+        }
+
+        if ( !done && TNClock::NowMs() >= deadline )
+            break;
+        if ( !done )
+            TNThread::Sleep( 1 );
+    }
+
+    // wake every receive thread before joining any of them
+    for ( it = drains.begin(); it != drains.end(); ++it )
+    {
+        unsigned long long unsent = (uDrainMs > 0) ? it->pClient->UnsentBytes() : 0;
+        if ( !it->bFlushed || unsent > 0 )
+        {
+            it->pClient->Abort(); // also fails a send blocked by another thread
+            stats.uBytesDropped += it->pClient->DiscardPending() + unsent;
+        }
+        else
+        {
+            it->pClient->Wake();
+        }
+
+        unsigned long long sent = it->pClient->BytesSent();
+        if ( !it->bStarted )
+            it->uSentBefore = sent;
+        if ( sent - it->uSentBefore > unsent )
+            stats.uBytesFlushed += sent - it->uSentBefore - unsent;
+    }
+
+    for ( it = drains.begin(); it != drains.end(); ++it )
+    {
+        it->pClient->Close();
+        it->pClient->Release();
+    }
+
+    return stats;
+}
+
+// static
+TNThread::RetVal TNAPI TelnetServer::ListenThreadEntry( void* arg )
+{
+    ((TelnetServer*)arg)->ListenThread();
+    TN_TRACE_THREAD_EXIT();
+    TNThread::Exit();
+
+    return 0;
+}
+
+void TelnetServer::ListenThread()
+{
+    bool done = false;
+
+    m_ListenSocketMutex.Lock();
+    TNSocketHandle listenSocket = m_ListenSocket;
+    done = (listenSocket == TNSocketHandle_Invalid);
+    m_ListenSocketMutex.Unlock();
+
+    while ( !done )
+    {
+        TNSocketHandle clientSocket = TNSocketHandle_Invalid;
+        clientSocket = accept( listenSocket, NULL, NULL );
+        if ( clientSocket != TNSocketHandle_Invalid )
+        {
+            Accept( clientSocket );
+        }
+
+        m_ListenSocketMutex.Lock();
+        listenSocket = m_ListenSocket;
+        done = (listenSocket == TNSocketHandle_Invalid);
+        m_ListenSocketMutex.Unlock();
+    }
+}
+
+void TelnetServer::StopListening()
+{
+    m_ListenSocketMutex.Lock();
+    TNSocketHandle listenSocket = m_ListenSocket;
+    m_ListenSocket = TNSocketHandle_Invalid;
+    std::string unixPath;
+    unixPath.swap( m_UnixPath );
+    std::string inprocName;
+    inprocName.swap( m_InprocName );
+    m_ListenSocketMutex.Unlock();
+
+    if ( !inprocName.empty() )
+    {
+        // waits for a connect in progress
+        TNInprocRegistry& registry = GetInprocRegistry();
+        registry.Mutex.Lock();
+        registry.Servers.erase( inprocName );
+        registry.Mutex.Unlock();
+    }
+
+    if ( listenSocket != TNSocketHandle_Invalid )
+    {
+        shutdown( listenSocket, TNSocketShutdown_Both ); // wakes 'accept' on Linux
+        closesocket( listenSocket );                     // wakes 'accept' elsewhere
+    }
+
+    if ( !m_ListenThread.IsInvalid() )
+    {
+        m_ListenThread.Join();
+        m_ListenThread.Invalidate();
+    }
+
+#if defined(TNPLATFORM_UNIX)
+    if ( !unixPath.empty() )
+        unlink( unixPath.c_str() );
+#endif
+}
+
+void TelnetServer::AcquireTargets( unsigned int uClient, TNConnectionList& targets )
+{
+    m_ClientsMutex.Lock();
+    if ( uClient == 0 )
+    {
+        targets.reserve( m_Clients.size() );
+        for ( TNConnectionMap::iterator it = m_Clients.begin(); it != m_Clients.end(); ++it )
+        {
+            TNConnectionPtr pClient = (*it).second;
+            pClient->AddRef();
+            targets.push_back( pClient );
+        }
+    }
+    else
+    {
+        TNConnectionMap::iterator it = m_Clients.find( uClient );
+        if ( it != m_Clients.end() )
+        {
+            TNConnectionPtr pClient = (*it).second;
+            pClient->AddRef();
+            targets.push_back( pClient );
+        }
+    }
+    m_ClientsMutex.Unlock();
+}
+
+bool TelnetServer::WriteAll( TNConnectionList& targets, const char* pText )
+{
+    std::size_t length = std::strlen( pText );
+
+    bool result = true;
+    for ( TNConnectionList::iterator it = targets.begin(); it != targets.end(); ++it )
+    {
+        TNConnectionPtr pClient = *it;
+        bool done = pClient->Write( pText, length, !HoldBack( pClient->ID() ) );
+        if ( !done )
+            result = false;
+        pClient->Release();
+    }
+
+    return result;
+}
+
+
+// static
+int TelnetNode::Initialize()
+{
+    int result = 0;
+#if defined(TNPLATFORM_WINDOWS)
+    WSADATA wsaData;
+    WORD wVersion = MAKEWORD( 2, 2 );
+    result = WSAStartup( wVersion, &wsaData );
+    if ( result != 0 )
+    {
+        WSACleanup();
+    }
+#endif // defined(TNPLATFORM_WINDOWS)
+    return result;
+}
+
+// static
+void TelnetNode::Finalize()
+{
+#if defined(TNPLATFORM_WINDOWS)
+    WSACleanup();
+#endif // defined(TNPLATFORM_WINDOWS)
+}
+
+// static
+TelnetNode* TelnetNode::CreateServer( unsigned int port )
+{
+    TelnetServer* pServer = new TelnetServer;
+
+    bool listenSucceeded = pServer->Listen( port );
+    if ( !listenSucceeded )
+    {
+        delete pServer;
+        return NULL;
+    }
+
+    return pServer;
+}
+
+// static
+TelnetNode* TelnetNode::CreateClient( const char* address, unsigned int port )
+{
+    TelnetClient* pClient = new TelnetClient;
+
+    bool connectSucceeded = pClient->Connect( address, port );
+    if ( !connectSucceeded )
+    {
+        delete pClient;
+        return NULL;
+    }
+
+    return pClient;
+}
+
+// static
+TelnetNode* TelnetNode::CreateServerUri( const char* uri )
+{
+    TelnetServer* pServer = new TelnetServer;
+
+    bool listenSucceeded = pServer->ListenUri( uri );
+    if ( !listenSucceeded )
+    {
+        delete pServer;
+        return NULL;
+    }
+
+    return pServer;
+}
+
+// static
+TelnetNode* TelnetNode::CreateClientUri( const char* uri )
+{
+    TelnetClient* pClient = new TelnetClient;
+
+    bool connectSucceeded = pClient->ConnectUri( uri );
+    if ( !connectSucceeded )
+    {
+        delete pClient;
+        return NULL;
+    }
+
+    return pClient;
+}
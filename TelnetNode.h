@@ -2,48 +2,65 @@
 #ifndef TELNETNODE_H_INCLUDED
 #define TELNETNODE_H_INCLUDED
 
+// TelnetNode.h : The public interface. The implementation is compiled into
+// the telnetnode library (TelnetNode.cpp); socket headers and macros stay
+// there.
+
 #include <cassert>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <algorithm>
 #include <map>
 #include <queue>
+#include <set>
+#include <string>
 #include <vector>
 
-#if defined(__APPLE__) || defined(LINUX) || defined(__CYGWIN__)
+#if defined(__APPLE__) || defined(__linux__) || defined(LINUX) || defined(__CYGWIN__)
 #  include <pthread.h>
-#  include <sys/types.h>
-#  include <sys/socket.h>
-#  include <arpa/inet.h>
-#  include <netinet/in.h>
-#  include <netdb.h>
 #  include <errno.h>
-#  include <cstdio>
+#  include <time.h>
+#  include <unistd.h>
 #  define TNPLATFORM_UNIX
-#elif defined(WIN32)
+#elif defined(_WIN32) || defined(WIN32)
 #  include <windows.h>
-#  include <stdio.h>
-#  define snprintf _snprintf
-#  pragma warning(disable: 4996) // suppress security warnings
 #  define TNPLATFORM_WINDOWS
 #else
 #  error "Unsupported Platform"
 #endif
 
+// std::to_chars formats TNWriter numbers when the standard library has it
+// for integers and floating point alike (__cpp_lib_to_chars).
+#if defined(__has_include)
+#  if __has_include(<charconv>) && (__cplusplus >= 201703L || (defined(_MSVC_LANG) && _MSVC_LANG >= 201703L))
+#    include <charconv>
+#    if defined(__cpp_lib_to_chars)
+#      define TN_HAS_TO_CHARS
+#    endif
+#  endif
+#endif
+
+// VS2013 and older lack C99 snprintf; TNWriter falls back on _snprintf,
+// which only differs when the buffer is too small.
+#if defined(_MSC_VER) && _MSC_VER < 1900
+#  define TN_SNPRINTF _snprintf
+#else
+#  define TN_SNPRINTF std::snprintf
+#endif
+
 #if defined(TNPLATFORM_UNIX)
 #  define TNAPI
 #elif defined(TNPLATFORM_WINDOWS)
 #  define TNAPI WINAPI
 #endif
 
-
 #if defined(TNPLATFORM_UNIX)
-#  define TNSocketHandle int
-#  define TNSocketHandle_Invalid -1
-#  define closesocket(socket_handle) close((socket_handle))
+typedef int TNSocketHandle;
 #elif defined(TNPLATFORM_WINDOWS)
-#  define TNSocketHandle SOCKET
-#  define TNSocketHandle_Invalid INVALID_SOCKET
-#  pragma comment(lib, "wsock32.lib")
+typedef SOCKET TNSocketHandle;
 #endif
 
 
@@ -78,6 +95,15 @@ public:
 #endif
         }
 
+    bool TryLock()
+        {
+#if defined(TNPLATFORM_UNIX)
+            return pthread_mutex_trylock( &m_Mutex ) == 0;
+#elif defined(TNPLATFORM_WINDOWS)
+            return ::TryEnterCriticalSection( &m_Mutex ) != FALSE;
+#endif
+        }
+
     void Unlock()
         {
 #if defined(TNPLATFORM_UNIX)
@@ -97,24 +123,147 @@ private:
 };
 
 
+// TNEvent : Auto-reset event. Set wakes one waiter, or the next one to wait.
+class TNEvent
+{
+public:
+    TNEvent()
+        {
+#if defined(TNPLATFORM_UNIX)
+            m_bSignaled = false;
+            pthread_mutex_init( &m_Mutex, 0 );
+            pthread_cond_init( &m_Cond, 0 );
+#elif defined(TNPLATFORM_WINDOWS)
+            m_hEvent = ::CreateEvent( NULL, FALSE, FALSE, NULL );
+#endif
+        }
+
+    ~TNEvent()
+        {
+#if defined(TNPLATFORM_UNIX)
+            pthread_cond_destroy( &m_Cond );
+            pthread_mutex_destroy( &m_Mutex );
+#elif defined(TNPLATFORM_WINDOWS)
+            ::CloseHandle( m_hEvent );
+#endif
+        }
+
+    void Set()
+        {
+#if defined(TNPLATFORM_UNIX)
+            pthread_mutex_lock( &m_Mutex );
+            m_bSignaled = true;
+            pthread_cond_signal( &m_Cond );
+            pthread_mutex_unlock( &m_Mutex );
+#elif defined(TNPLATFORM_WINDOWS)
+            ::SetEvent( m_hEvent );
+#endif
+        }
+
+    static const unsigned int Infinite = 0xFFFFFFFF;
+
+    // Returns false on timeout. Infinite waits until Set.
+    bool Wait( unsigned int uTimeoutMs )
+        {
+#if defined(TNPLATFORM_UNIX)
+            if ( uTimeoutMs == Infinite )
+            {
+                pthread_mutex_lock( &m_Mutex );
+                while ( !m_bSignaled )
+                    pthread_cond_wait( &m_Cond, &m_Mutex );
+                m_bSignaled = false;
+                pthread_mutex_unlock( &m_Mutex );
+                return true;
+            }
+
+            timespec deadline;
+            clock_gettime( CLOCK_REALTIME, &deadline );
+            deadline.tv_sec  += uTimeoutMs / 1000;
+            deadline.tv_nsec += (uTimeoutMs % 1000) * 1000000L;
+            if ( deadline.tv_nsec >= 1000000000L )
+            {
+                deadline.tv_sec  += 1;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            pthread_mutex_lock( &m_Mutex );
+            while ( !m_bSignaled )
+            {
+                if ( pthread_cond_timedwait( &m_Cond, &m_Mutex, &deadline ) == ETIMEDOUT )
+                    break;
+            }
+            bool result = m_bSignaled;
+            m_bSignaled = false;
+            pthread_mutex_unlock( &m_Mutex );
+
+            return result;
+#elif defined(TNPLATFORM_WINDOWS)
+            return ::WaitForSingleObject( m_hEvent, (uTimeoutMs == Infinite) ? INFINITE : uTimeoutMs ) == WAIT_OBJECT_0;
+#endif
+        }
+
+private:
+
+#if defined(TNPLATFORM_UNIX)
+    bool            m_bSignaled;
+    pthread_mutex_t m_Mutex;
+    pthread_cond_t  m_Cond;
+#elif defined(TNPLATFORM_WINDOWS)
+    HANDLE          m_hEvent;
+#endif
+};
+
+
+// TNCpuSet : CPU numbers as the OS counts them.
+typedef std::vector<unsigned int> TNCpuSet;
+typedef std::vector<TNCpuSet> TNCpuSetList;
+
+enum TNSchedPolicy
+{
+    TNSched_Default,   // inherited from the creating thread
+    TNSched_Normal,    // SCHED_OTHER / THREAD_PRIORITY_NORMAL
+    TNSched_Batch,     // SCHED_BATCH on Linux / THREAD_PRIORITY_BELOW_NORMAL
+    TNSched_Idle,      // SCHED_IDLE on Linux / THREAD_PRIORITY_IDLE
+    TNSched_Fifo,      // SCHED_FIFO / THREAD_PRIORITY_TIME_CRITICAL; needs privileges
+    TNSched_RoundRobin // SCHED_RR / THREAD_PRIORITY_HIGHEST; needs privileges
+};
+
+// TNThreadAttributes : How TNThread::Run starts a thread. The defaults are
+// those of the platform.
+struct TNThreadAttributes
+{
+    std::size_t   uStackSize; // bytes; 0: platform default
+    std::string   Name;       // shown by debuggers and 'top -H'; Linux keeps 15 characters
+    TNCpuSet      Cpus;       // CPUs the thread may run on; empty: any
+    TNSchedPolicy Policy;
+    int           iPriority;  // for TNSched_Fifo and TNSched_RoundRobin (1-99 on Linux)
+
+    TNThreadAttributes()
+        : uStackSize(0)
+        , Name()
+        , Cpus()
+        , Policy(TNSched_Default)
+        , iPriority(0)
+        {}
+};
+
+
 // TNThread : Abstraction layer for platform threading APIs.
 class TNThread
 {
 public:
 
 #if defined(TNPLATFORM_UNIX)
-    static const int InvalidHandle = 0;
     typedef pthread_t Handle;
     typedef void* RetVal;
 #elif defined(TNPLATFORM_WINDOWS)
-#  define InvalidHandle NULL
     typedef HANDLE Handle;
     typedef DWORD RetVal;
 #endif
     typedef RetVal (TNAPI *EntryFunc)( void* arg );
 
     TNThread()
-        :m_hThread(InvalidHandle) {}
+        :m_hThread() {}
 
     ~TNThread()
         {}
@@ -128,6 +277,13 @@ public:
 #endif
         }
 
+    // Stack size and scheduling are applied at creation; when the OS refuses
+    // them the thread is started with the defaults and false is returned.
+    // Name, CPU set and the Linux policies TNSched_Batch and TNSched_Idle
+    // are applied by the new thread itself before pfnFunc runs (best
+    // effort). IsInvalid() tells whether a thread was started.
+    bool Run( EntryFunc pfnFunc, void* pArg, const TNThreadAttributes& attr );
+
     void Join()
         {
 #if defined(TNPLATFORM_UNIX)
@@ -139,10 +295,10 @@ public:
         }
 
     void Invalidate()
-        { m_hThread = InvalidHandle; }
+        { m_hThread = Handle(); }
 
     bool IsInvalid()
-        { return m_hThread == InvalidHandle; }
+        { return m_hThread == Handle(); }
 
     static void Exit()
         {
@@ -153,596 +309,1341 @@ public:
 #endif
         }
 
+    static void Sleep( unsigned int uMilliseconds )
+        {
+#if defined(TNPLATFORM_UNIX)
+            usleep( uMilliseconds * 1000 );
+#elif defined(TNPLATFORM_WINDOWS)
+            ::Sleep( uMilliseconds );
+#endif
+        }
+
+    // Restricts the calling thread to cpus. Returns false if the platform
+    // has no affinity API (macOS) or the set is rejected.
+    static bool SetAffinity( const TNCpuSet& cpus );
+
+    // Names the calling thread.
+    static void SetName( const char* pName );
+
 private:
 
+    struct StartInfo;
+    static RetVal TNAPI StartEntry( void* arg );
+
     Handle m_hThread;
 };
 
 
-// TNTextPtr : A single line string
-typedef char* TNTextPtr;
+// TNTopology : CPUs and NUMA nodes of the machine. Linux reads the nodes
+// from /sys/devices/system/node, Windows asks the NUMA API; elsewhere all
+// CPUs form a single node.
+class TNTopology
+{
+public:
 
+    // CPUs this process may run on.
+    static TNCpuSet AllowedCpus();
 
-// TNMessage : Text received from peer node
-struct TNMessage
+    // CPUs of each online node, in node order.
+    static TNCpuSetList Nodes();
+};
+
+
+// TNClock : Monotonic millisecond clock.
+class TNClock
 {
-    TNTextPtr Text;
-    unsigned int ID;
+public:
 
-    TNMessage( TNTextPtr pText, unsigned int uID )
-        : Text(pText)
-        , ID(uID)
-        {}
+    static unsigned long long NowMs()
+        {
+#if defined(TNPLATFORM_UNIX)
+            timespec ts;
+            clock_gettime( CLOCK_MONOTONIC, &ts );
+            return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#elif defined(TNPLATFORM_WINDOWS)
+            return ::GetTickCount64();
+#endif
+        }
 
-    ~TNMessage()
+    static unsigned long long NowUs()
         {
-            delete Text;
+#if defined(TNPLATFORM_UNIX)
+            timespec ts;
+            clock_gettime( CLOCK_MONOTONIC, &ts );
+            return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#elif defined(TNPLATFORM_WINDOWS)
+            LARGE_INTEGER frequency, counter;
+            ::QueryPerformanceFrequency( &frequency );
+            ::QueryPerformanceCounter( &counter );
+            return (unsigned long long)(counter.QuadPart / frequency.QuadPart) * 1000000
+                 + (unsigned long long)(counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#endif
         }
 };
 
-typedef TNMessage* TNMessagePtr;
-typedef std::queue<TNMessagePtr> TNMessageQueue;
 
-// TNReceiveBuffer :
-// * Stocks 'recv'ed data
-// * Splits data into lines of text
-class TNReceiveBuffer
+// Tracing : compile with TN_ENABLE_TRACE to record how long each stage of
+// the message path takes. Without it the trace points compile to nothing.
+//
+// * TN_TRACE_SCOPE( "name", arg ) records the enclosing scope;
+//   TN_TRACE_BEGIN( var ) ... TN_TRACE_END( "name", var, arg ) records a span
+//   whose argument is known only at its end
+// * Built-in names : "recv" (blocking wait included), "append" (telnet
+//   parsing and framing), "message lock" (contended wait on the message queue) and
+//   "send"; the application adds its own, e.g. "handler"
+// * Each thread writes into its own ring buffer (last TN_TRACE_RING_SIZE
+//   events) without locking; the exporter copies rings concurrently and
+//   drops the events overwritten meanwhile
+// * TNTrace::Export writes Chrome trace-event JSON, which chrome://tracing
+//   and ui.perfetto.dev open as a per-thread timeline
+#if defined(TN_ENABLE_TRACE)
+
+#  if !defined(TN_TRACE_RING_SIZE)
+#    define TN_TRACE_RING_SIZE 8192 // events per thread, power of two
+#  endif
+
+#  if defined(TNPLATFORM_UNIX)
+#    define TN_TRACE_THREAD_LOCAL __thread
+#    define TN_TRACE_BARRIER() __sync_synchronize()
+#  elif defined(TNPLATFORM_WINDOWS)
+#    define TN_TRACE_THREAD_LOCAL __declspec(thread)
+#    define TN_TRACE_BARRIER() MemoryBarrier()
+#  endif
+
+struct TNTraceEvent
 {
-public:
-    typedef std::vector<char> RawBuffer;
-    typedef std::queue<TNTextPtr> TextQueue;
+    const char*        pName;   // string literal
+    unsigned long long uBeginUs;
+    unsigned int       uDurationUs;
+    unsigned int       uArg;
+    unsigned int       uThread;
+};
 
-    TNReceiveBuffer( unsigned int uInitialSize = 8192 )
-        {
-            m_Buffer.reserve( uInitialSize );
-        }
+// TNTraceRing : Single-writer ring of trace events.
+class TNTraceRing
+{
+public:
+    static const unsigned int Capacity = TN_TRACE_RING_SIZE;
 
-    ~TNReceiveBuffer()
+    TNTraceRing()
+        : m_uHead(0)
+        , m_uThread(0)
         {}
 
-    bool Empty()
+    void SetThread( unsigned int uThread )
+        { m_uThread = uThread; }
+
+    // Owner thread only.
+    void Push( const char* pName, unsigned long long uBeginUs, unsigned int uDurationUs, unsigned int uArg )
         {
-            return m_Texts.empty();
+            unsigned int head = m_uHead;
+            TNTraceEvent& event = m_Events[head & (Capacity - 1)];
+            event.pName       = pName;
+            event.uBeginUs    = uBeginUs;
+            event.uDurationUs = uDurationUs;
+            event.uArg        = uArg;
+            event.uThread     = m_uThread;
+            TN_TRACE_BARRIER(); // publish the event before the index
+            m_uHead = head + 1;
         }
 
-    TNTextPtr GetText()
+    // Any thread. Appends the events that were stable during the copy.
+    void Snapshot( std::vector<TNTraceEvent>& events )
         {
-            TNTextPtr result = NULL;
-            if ( !m_Texts.empty() )
+            unsigned int end = m_uHead;
+            TN_TRACE_BARRIER();
+            unsigned int begin = (end > Capacity) ? end - Capacity : 0;
+
+            std::size_t first = events.size();
+            for ( unsigned int i = begin; i != end; ++i )
+                events.push_back( m_Events[i & (Capacity - 1)] );
+
+            // the writer may have reused the oldest slots (and may be
+            // writing the slot of index 'head') while we were copying
+            TN_TRACE_BARRIER();
+            unsigned int head = m_uHead;
+            unsigned int stable = (head + 1 > Capacity) ? head + 1 - Capacity : 0;
+            if ( stable > begin )
             {
-                result = m_Texts.front();
-                m_Texts.pop();
+                std::size_t torn = std::min<std::size_t>( stable - begin, events.size() - first );
+                events.erase( events.begin() + first, events.begin() + first + torn );
             }
+        }
 
-            return result;
+private:
+
+    volatile unsigned int m_uHead;
+    unsigned int          m_uThread;
+    TNTraceEvent          m_Events[Capacity];
+};
+
+// TNTrace : Registry of the per-thread rings and the exporter.
+class TNTrace
+{
+public:
+
+    static void Record( const char* pName, unsigned long long uBeginUs, unsigned int uDurationUs, unsigned int uArg )
+        {
+            ThreadRing()->Push( pName, uBeginUs, uDurationUs, uArg );
         }
 
-    void Append( const char* pBuffer, unsigned int uBufferSize )
+    // Hands the calling thread's ring to the next new thread. Its events are
+    // kept until overwritten.
+    static void ThreadExit()
         {
-            if ( !pBuffer || uBufferSize == 0 )
+            TNTraceRing*& pRing = ThreadRingSlot();
+            if ( pRing == NULL )
                 return;
 
-            // stock
-            if ( m_Buffer.size() + uBufferSize >= m_Buffer.capacity() )
-                m_Buffer.resize( m_Buffer.capacity() + uBufferSize );
-
-            m_Buffer.insert( m_Buffer.end(), pBuffer, pBuffer+uBufferSize );
+            Registry& registry = GetRegistry();
+            registry.Mutex.Lock();
+            registry.Idle.push_back( pRing );
+            registry.Mutex.Unlock();
+            pRing = NULL;
+        }
 
-            // split
-            RawBuffer::iterator it_head = m_Buffer.begin();
-            RawBuffer::iterator it_tail = std::find( it_head, m_Buffer.end(), '\n' );
-            while ( it_tail != m_Buffer.end() )
+    static bool Export( std::FILE* pFile )
+        {
+            if ( pFile == NULL )
+                return false;
+
+            std::vector<TNTraceEvent> events;
+            Registry& registry = GetRegistry();
+            registry.Mutex.Lock();
+            for ( std::size_t i = 0; i < registry.Rings.size(); ++i )
+                registry.Rings[i]->Snapshot( events );
+            registry.Mutex.Unlock();
+
+            std::fprintf( pFile, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" );
+            for ( std::size_t i = 0; i < events.size(); ++i )
             {
-                unsigned int length = (it_tail - it_head);
-                char* pRawNewText = new char[length+2]; // 2 == '\n'+'\0'
-                // std::copy( it_head, it_tail+1, pRawNewText ); // +1 == '\n' // VC++2010 warns std::copy is unsafe
-                std::memcpy( pRawNewText, &(*it_head), length+1 ); // +1 == '\n'
-                pRawNewText[length+1] = '\0';
-                m_Texts.push( pRawNewText ); // deleted at ~TNMessage
-                it_head = it_tail + 1;
-                if ( it_head == m_Buffer.end() )
-                    break;
-                it_tail = std::find( it_head, m_Buffer.end(), '\n' );
+                const TNTraceEvent& event = events[i];
+                std::fprintf( pFile, "%s\n{\"name\":\"%s\",\"cat\":\"tn\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+                              "\"ts\":%llu,\"dur\":%u,\"args\":{\"arg\":%u}}",
+                              (i == 0) ? "" : ",", event.pName, event.uThread,
+                              event.uBeginUs, event.uDurationUs, event.uArg );
             }
+            std::fprintf( pFile, "\n]}\n" );
 
-            m_Buffer.clear();
+            return std::ferror( pFile ) == 0;
         }
 
-private:
+    static bool ExportToFile( const char* pPath )
+        {
+            std::FILE* pFile = std::fopen( pPath, "w" );
+            bool result = Export( pFile );
+            if ( pFile != NULL )
+                std::fclose( pFile );
 
-    RawBuffer m_Buffer;
-    TextQueue m_Texts;
-}; // End : TNReceiveBuffer
+            return result;
+        }
 
+    // Async-signal-safe: only raises a flag for ExportIfRequested.
+    static void RequestExport()
+        { ExportRequested() = 1; }
 
-// TelnetNode : The public interface
-class TelnetNode
-{
-public:
+    // Call periodically (e.g. from the main loop) to serve RequestExport.
+    static bool ExportIfRequested( const char* pPath )
+        {
+            if ( !ExportRequested() )
+                return false;
 
-    static int Initialize();
-    static void Finalize();
+            ExportRequested() = 0;
+            return ExportToFile( pPath );
+        }
 
-    static TelnetNode* CreateServer( unsigned int port = 23 );
-    static TelnetNode* CreateClient( const char* address = "LOCALHOST", unsigned int port = 23 );
-    static void ReleaseNode( TelnetNode* pNode )
-        { delete pNode; }
+#if defined(TNPLATFORM_UNIX)
+    // e.g. TNTrace::InstallSignal( SIGUSR1 ), then 'kill -USR1 <pid>'
+    static void InstallSignal( int signalNumber )
+        { std::signal( signalNumber, SignalHandler ); }
+#endif
 
-    virtual bool IsServer() =0;
+private:
 
-    virtual bool SendText( const char* pText, unsigned int uClient = 0 ) =0;
+    struct Registry
+    {
+        TNMutex                   Mutex;
+        std::vector<TNTraceRing*> Rings;
+        std::vector<TNTraceRing*> Idle;
+    };
 
-    void PushReceivedText( TNTextPtr pText, unsigned int uClient = 0 )
+    static Registry& GetRegistry()
         {
-            m_MessageMutex.Lock();
-            TNMessagePtr msg( new TNMessage(pText, uClient) );
-            m_Messages.push( msg ); // deleted at DeleteReceivedText
-            m_MessageMutex.Unlock();
+            static Registry registry; // rings live until the process ends
+            return registry;
         }
 
-    void DeleteReceivedText( TNMessagePtr pUnusedMsg )
-        { delete pUnusedMsg; }
+    static TNTraceRing*& ThreadRingSlot()
+        {
+            static TN_TRACE_THREAD_LOCAL TNTraceRing* pRing = NULL;
+            return pRing;
+        }
 
-    TNMessagePtr PopReceivedText()
+    static TNTraceRing* ThreadRing()
         {
-            TNMessagePtr result = NULL;
-            m_MessageMutex.Lock();
-            if ( !m_Messages.empty() )
+            TNTraceRing*& pRing = ThreadRingSlot();
+            if ( pRing == NULL )
             {
-                result = m_Messages.front();
-                m_Messages.pop();
+                Registry& registry = GetRegistry();
+                registry.Mutex.Lock();
+                if ( !registry.Idle.empty() )
+                {
+                    pRing = registry.Idle.back();
+                    registry.Idle.pop_back();
+                }
+                else
+                {
+                    pRing = new TNTraceRing;
+                    registry.Rings.push_back( pRing );
+                }
+                static unsigned int threadCount = 0;
+                pRing->SetThread( ++threadCount );
+                registry.Mutex.Unlock();
             }
-            m_MessageMutex.Unlock();
 
-            return result;
+            return pRing;
         }
 
-protected:
+    static volatile std::sig_atomic_t& ExportRequested()
+        {
+            static volatile std::sig_atomic_t requested = 0;
+            return requested;
+        }
 
-    TelnetNode() {}
-    virtual ~TelnetNode() {}
-    TelnetNode& operator=( const TelnetNode& other );
+    static void SignalHandler( int /*signalNumber*/ )
+        { RequestExport(); }
+};
+
+// TNTraceScope : Records the lifetime of a scope.
+class TNTraceScope
+{
+public:
+    TNTraceScope( const char* pName, unsigned int uArg = 0 )
+        : m_pName(pName)
+        , m_uArg(uArg)
+        , m_uBeginUs(TNClock::NowUs())
+        {}
+
+    ~TNTraceScope()
+        {
+            TNTrace::Record( m_pName, m_uBeginUs, (unsigned int)(TNClock::NowUs() - m_uBeginUs), m_uArg );
+        }
+
+    void SetArg( unsigned int uArg )
+        { m_uArg = uArg; }
 
 private:
+    const char*        m_pName;
+    unsigned int       m_uArg;
+    unsigned long long m_uBeginUs;
+};
 
-    TNMutex m_MessageMutex;
-    TNMessageQueue m_Messages;
-}; // End : TelnetNode
+#  define TN_TRACE_CONCAT_( a, b ) a##b
+#  define TN_TRACE_CONCAT( a, b ) TN_TRACE_CONCAT_( a, b )
+#  define TN_TRACE_SCOPE( name, arg ) TNTraceScope TN_TRACE_CONCAT( tnTraceScope, __LINE__ )( (name), (arg) )
+#  define TN_TRACE_BEGIN( var ) unsigned long long var = TNClock::NowUs()
+#  define TN_TRACE_END( name, var, arg ) TNTrace::Record( (name), (var), (unsigned int)(TNClock::NowUs() - (var)), (arg) )
+#  define TN_TRACE_THREAD_EXIT() TNTrace::ThreadExit()
 
+#else // defined(TN_ENABLE_TRACE)
 
-// TNConnection : a connection established to the endpoint
-class TNConnection
+// Keeps exporting code compilable when tracing is compiled out.
+class TNTrace
 {
 public:
+    static bool Export( std::FILE* /*pFile*/ )              { return false; }
+    static bool ExportToFile( const char* /*pPath*/ )       { return false; }
+    static void RequestExport()                             {}
+    static bool ExportIfRequested( const char* /*pPath*/ )  { return false; }
+#if defined(TNPLATFORM_UNIX)
+    static void InstallSignal( int /*signalNumber*/ )       {}
+#endif
+};
+
+#  define TN_TRACE_SCOPE( name, arg ) ((void)0)
+#  define TN_TRACE_BEGIN( var ) ((void)0)
+#  define TN_TRACE_END( name, var, arg ) ((void)0)
+#  define TN_TRACE_THREAD_EXIT() ((void)0)
+
+#endif // defined(TN_ENABLE_TRACE)
+
 
-    TNConnection( TelnetNode* pNode, TNSocketHandle hSocket, unsigned int uID )
-        : m_Thread()
-        , m_Socket(hSocket)
-        , m_SocketMutex()
-        , m_pNode(pNode)
-        , m_uID(uID)
+class TNTimerWheel;
+
+// TNTimer : An intrusive timer entry. The owner keeps it alive while it is
+// linked into a TNTimerWheel, so arming/disarming never allocates.
+struct TNTimer
+{
+    typedef void (*Callback)( TNTimerWheel& wheel, TNTimer* pTimer, void* pArg );
+
+    TNTimer*           pPrev;
+    TNTimer*           pNext;
+    unsigned long long uExpire; // in ticks
+    Callback           pfnCallback;
+    void*              pArg;
+
+    TNTimer( Callback pfn = NULL, void* arg = NULL )
+        : pPrev(NULL)
+        , pNext(NULL)
+        , uExpire(0)
+        , pfnCallback(pfn)
+        , pArg(arg)
         {}
 
-    ~TNConnection()
+    bool IsPending() const
+        { return pNext != NULL; }
+};
+
+
+// TNTimerWheel : Hierarchical timing wheel (4 levels x 256 slots).
+// * Add/Remove are O(1)
+// * Advance costs one slot visit per tick plus an occasional cascade
+// * Not thread-safe; the owner serializes access
+class TNTimerWheel
+{
+public:
+    static const unsigned int LevelBits  = 8;
+    static const unsigned int LevelSlots = 1 << LevelBits;
+    static const unsigned int LevelMask  = LevelSlots - 1;
+    static const unsigned int Levels     = 4;
+
+    TNTimerWheel( unsigned int uTickMs = 10 )
+        : m_uTickMs(uTickMs)
+        , m_uCurrent(0)
+        , m_uCount(0)
         {
-            Close();
+            for ( unsigned int level = 0; level < Levels; ++level )
+            {
+                for ( unsigned int slot = 0; slot < LevelSlots; ++slot )
+                {
+                    TNTimer& head = m_Slots[level][slot];
+                    head.pPrev = head.pNext = &head;
+                }
+            }
         }
 
-    bool Send( const char* pText, std::size_t uLength )
+    unsigned int TickMs() const
+        { return m_uTickMs; }
+
+    unsigned long long Current() const
+        { return m_uCurrent; }
+
+    bool Empty() const
+        { return m_uCount == 0; }
+
+    unsigned long long ToTicks( unsigned int uMilliseconds ) const
+        { return (uMilliseconds + m_uTickMs - 1) / m_uTickMs; }
+
+    // Moves the wheel to 'uTick' without firing anything. Only valid while empty.
+    void Reset( unsigned long long uTick )
         {
-            m_SocketMutex.Lock();
-            int flags = 0;
-            int bytes = send( m_Socket, pText, uLength, flags);
-            m_SocketMutex.Unlock();
+            assert( Empty() );
+            m_uCurrent = uTick;
+        }
 
-            return bytes >= 0;
+    void Add( TNTimer* pTimer, unsigned long long uExpire )
+        {
+            Remove( pTimer );
+            pTimer->uExpire = (uExpire < m_uCurrent) ? m_uCurrent : uExpire;
+            Place( pTimer );
+            ++m_uCount;
         }
 
-    void Close()
+    void AddAfter( TNTimer* pTimer, unsigned int uDelayMs )
         {
-            if ( m_Socket != TNSocketHandle_Invalid )
+            Add( pTimer, m_uCurrent + ToTicks(uDelayMs) );
+        }
+
+    void Remove( TNTimer* pTimer )
+        {
+            if ( pTimer->IsPending() )
             {
-                m_SocketMutex.Lock();
-                closesocket( m_Socket );
-                m_Socket = TNSocketHandle_Invalid;
-                m_SocketMutex.Unlock();
+                Unlink( pTimer );
+                --m_uCount;
+            }
+        }
 
-                m_Thread.Join();
-                m_Thread.Invalidate();
+    // First tick at which Advance has work to do: a level-0 slot to fire or
+    // a higher-level slot to cascade. Only meaningful while not Empty().
+    unsigned long long NextTick() const
+        {
+            unsigned long long next = ~0ULL;
+            for ( unsigned int level = 0; level < Levels; ++level )
+            {
+                unsigned int shift = LevelBits * level;
+                unsigned long long step = 1ULL << shift;
+                unsigned long long tick = (m_uCurrent + step - 1) & ~(step - 1);
+                for ( unsigned int i = 0; i < LevelSlots && tick < next; ++i, tick += step )
+                {
+                    const TNTimer& head = m_Slots[level][(tick >> shift) & LevelMask];
+                    if ( head.pNext != &head )
+                    {
+                        next = tick;
+                        break;
+                    }
+                }
             }
+            return next;
         }
 
-    void Start()
+    // Fires every timer expiring at or before 'uTick'. Callbacks may re-arm.
+    void Advance( unsigned long long uTick )
         {
-            m_Thread.Run( ReceiveThreadEntry, this );
+            while ( m_uCurrent <= uTick )
+            {
+                if ( m_uCount == 0 )
+                {
+                    m_uCurrent = uTick + 1;
+                    break;
+                }
+
+                // cascade from the top so that every timer lands in its final slot
+                for ( unsigned int level = Levels - 1; level > 0; --level )
+                {
+                    unsigned long long lowerMask = (1ULL << (LevelBits * level)) - 1;
+                    if ( (m_uCurrent & lowerMask) == 0 )
+                        Cascade( level, (unsigned int)((m_uCurrent >> (LevelBits * level)) & LevelMask) );
+                }
+
+                TNTimer expired;
+                expired.pPrev = expired.pNext = &expired;
+                Splice( m_Slots[0][m_uCurrent & LevelMask], expired );
+                ++m_uCurrent;
+
+                while ( expired.pNext != &expired )
+                {
+                    TNTimer* pTimer = expired.pNext;
+                    Unlink( pTimer );
+                    --m_uCount;
+                    pTimer->pfnCallback( *this, pTimer, pTimer->pArg );
+                }
+            }
         }
 
 private:
 
-    static TNThread::RetVal TNAPI ReceiveThreadEntry( void* arg )
+    void Place( TNTimer* pTimer )
+        {
+            unsigned long long delta = pTimer->uExpire - m_uCurrent;
+            unsigned int level = 0;
+            while ( level < Levels - 1 && delta >= (1ULL << (LevelBits * (level + 1))) )
+                ++level;
+
+            if ( level == Levels - 1 && delta >= (1ULL << (LevelBits * Levels)) )
+                pTimer->uExpire = m_uCurrent + (1ULL << (LevelBits * Levels)) - 1;
+
+            TNTimer& head = m_Slots[level][(pTimer->uExpire >> (LevelBits * level)) & LevelMask];
+            pTimer->pNext = &head;
+            pTimer->pPrev = head.pPrev;
+            head.pPrev->pNext = pTimer;
+            head.pPrev = pTimer;
+        }
+
+    void Cascade( unsigned int level, unsigned int slot )
         {
-            ((TNConnection*)arg)->ReceiveThread();
-            TNThread::Exit();
+            TNTimer pending;
+            pending.pPrev = pending.pNext = &pending;
+            Splice( m_Slots[level][slot], pending );
 
-            return 0;
+            while ( pending.pNext != &pending )
+            {
+                TNTimer* pTimer = pending.pNext;
+                Unlink( pTimer );
+                Place( pTimer );
+            }
         }
 
-    void ReceiveThread()
+    static void Unlink( TNTimer* pTimer )
         {
-            bool done = false;
+            pTimer->pPrev->pNext = pTimer->pNext;
+            pTimer->pNext->pPrev = pTimer->pPrev;
+            pTimer->pPrev = pTimer->pNext = NULL;
+        }
 
-            m_SocketMutex.Lock();
-            TNSocketHandle clientSocket = m_Socket;
-            done = (clientSocket == TNSocketHandle_Invalid);
-            m_SocketMutex.Unlock();
+    // Moves every entry of 'from' into the empty list 'to'.
+    static void Splice( TNTimer& from, TNTimer& to )
+        {
+            if ( from.pNext == &from )
+                return;
 
-            const unsigned int rawBufSize = 8192;
-            char rawBuffer[rawBufSize];
+            to.pNext = from.pNext;
+            to.pPrev = from.pPrev;
+            to.pNext->pPrev = &to;
+            to.pPrev->pNext = &to;
+            from.pPrev = from.pNext = &from;
+        }
 
-            TNReceiveBuffer receiveBuffer;
+    unsigned int       m_uTickMs;
+    unsigned long long m_uCurrent; // next tick to be processed
+    unsigned int       m_uCount;
+    TNTimer            m_Slots[Levels][LevelSlots];
+}; // End : TNTimerWheel
 
-            while ( !done )
-            {
-                int flags = 0;
-                int bytes = recv( clientSocket, rawBuffer, rawBufSize, flags );
 
-                if ( bytes > 0 )
-                {
-                    receiveBuffer.Append( rawBuffer, bytes );
-                }
-                else
-                {
-                    done = true;
-                    m_SocketMutex.Lock();
-                    closesocket( clientSocket );
-                    clientSocket = TNSocketHandle_Invalid;
-                    m_Socket = clientSocket;
-                    m_SocketMutex.Unlock();
-                }
+// TNTimeoutConfig : Timing policy applied to each new connection.
+// Durations are in milliseconds unless noted; 0 disables the feature.
+struct TNTimeoutConfig
+{
+    unsigned int uIdleTimeout;          // close when nothing is received for this long
+    unsigned int uKeepAliveInterval;    // send Telnet NOP when nothing is received for this long
+    unsigned int uRequestDeadline;      // close when a started line is not completed in time
+    unsigned int uTcpKeepAliveIdle;     // SO_KEEPALIVE idle time [s]
+    unsigned int uTcpKeepAliveInterval; // interval between TCP keep-alive probes [s]
+    unsigned int uTcpKeepAliveCount;    // unanswered probes before the peer is dropped
+
+    TNTimeoutConfig()
+        : uIdleTimeout(0)
+        , uKeepAliveInterval(0)
+        , uRequestDeadline(0)
+        , uTcpKeepAliveIdle(0)
+        , uTcpKeepAliveInterval(0)
+        , uTcpKeepAliveCount(0)
+        {}
+};
 
-                while ( !receiveBuffer.Empty() )
-                {
-                    m_pNode->PushReceivedText( receiveBuffer.GetText(), m_uID );
-                }
 
-                m_SocketMutex.Lock();
-                clientSocket = m_Socket;
-                done = (clientSocket == TNSocketHandle_Invalid);
-                m_SocketMutex.Unlock();
-            }
-        }
+// TNReceiveConfig : Limits on what a peer may send, applied to each new
+// connection. A peer exceeding them is disconnected.
+struct TNReceiveConfig
+{
+    unsigned int uMaxLineLength; // bytes, '\n' included; 0: unlimited
+    bool         bFrames;        // accept binary frames; off: they are skipped
+    unsigned int uMaxFrameSize;  // payload bytes, up to TNFrame_MaxSize
+
+    TNReceiveConfig()
+        : uMaxLineLength(64 * 1024)
+        , bFrames(false)
+        , uMaxFrameSize(1024 * 1024)
+        {}
+};
 
-    TNThread       m_Thread;
-    TNSocketHandle m_Socket;
-    TNMutex        m_SocketMutex;
-    TelnetNode*    m_pNode;
-    unsigned int   m_uID;
+
+// TNTextPtr : A single line string
+typedef char* TNTextPtr;
+
+
+enum TNMessageType
+{
+    TNMessage_Text,      // a line of text, '\n' included
+    TNMessage_Frame,     // a binary frame sent with TelnetNode::SendFrame
+    TNMessage_Connect,   // a client connected; its first data may come earlier (see SetConnectionEvents)
+    TNMessage_Disconnect // the connection to ID is gone (see SetConnectionEvents)
 };
 
-typedef TNConnection* TNConnectionPtr;
-typedef std::map<unsigned int, TNConnectionPtr> TNConnectionMap;
+// Binary frames travel in the text stream as
+//   IAC SB TNTelnetOption_Frame <tag:2> <size:4> <payload:size>
+// with tag and size in network byte order and the payload unescaped.
+static const unsigned int TNFrame_HeaderSize = 9;
+static const unsigned int TNFrame_MaxSize    = 16 * 1024 * 1024;
 
 
-// TelnetClient : Provides the client-specific implementation (Connect, etc.)
-class TelnetClient : public TelnetNode
+// TNMessage : Text or binary frame received from peer node
+struct TNMessage
 {
-public:
-    TelnetClient()
-        : m_pServer()
+    TNTextPtr      Text; // the line, the frame payload, or "" for connection
+                         // events; never NULL, always '\0'-terminated
+    unsigned int   ID;
+    TNMessageType  Type;
+    unsigned int   Size; // bytes in Text, excluding the terminating '\0'
+    unsigned short Tag;  // set by the sender of a frame
+
+    TNMessage( TNTextPtr pText, unsigned int uID )
+        : Text(pText)
+        , ID(uID)
+        , Type(TNMessage_Text)
+        , Size(pText ? std::strlen(pText) : 0)
+        , Tag(0)
         {}
 
-    virtual ~TelnetClient()
+    TNMessage( TNMessageType type, unsigned int uID )
+        : Text(new char[1]())
+        , ID(uID)
+        , Type(type)
+        , Size(0)
+        , Tag(0)
+        {}
+
+    TNMessage( TNTextPtr pData, unsigned int uSize, unsigned short uTag, unsigned int uID )
+        : Text(pData)
+        , ID(uID)
+        , Type(TNMessage_Frame)
+        , Size(uSize)
+        , Tag(uTag)
+        {}
+
+    ~TNMessage()
         {
-            Close();
+            delete [] Text;
         }
 
-    virtual bool IsServer()
-        { return false; }
+    bool IsFrame() const
+        { return Type == TNMessage_Frame; }
 
-    virtual bool SendText( const char* pText, unsigned int /*uClient*/ = 0 )
+    // Copies a POD frame payload out; fails on size mismatch.
+    template <typename T>
+    bool Get( T& value ) const
         {
-            const unsigned int rawBufSize = 8192;
-            char rawBuffer[rawBufSize];
-            snprintf( rawBuffer, 8192, "%s", pText );
-            std::size_t length = std::strlen( rawBuffer );
-            bool result = m_pServer->Send( rawBuffer, length );
+            if ( !IsFrame() || Size != sizeof(T) )
+                return false;
 
-            return result;
+            std::memcpy( &value, Text, sizeof(T) );
+            return true;
         }
 
-    bool Connect( const char* address = "LOCALHOST", unsigned int port = 23 )
+    // Views a frame payload as an array of POD in place. Returns NULL on
+    // size mismatch. 'new char[]' storage is suitably aligned for any T
+    // with fundamental alignment.
+    template <typename T>
+    const T* GetArray( std::size_t& uCount ) const
         {
-            bool result = false;
+            uCount = 0;
+            if ( !IsFrame() || Size % sizeof(T) != 0 )
+                return NULL;
 
-            Close();
+            uCount = Size / sizeof(T);
+            return reinterpret_cast<const T*>( Text );
+        }
+};
 
-            TNSocketHandle serverSocket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
-            if ( serverSocket != TNSocketHandle_Invalid )
-            {
-                sockaddr_in service = { 0 };
+typedef TNMessage* TNMessagePtr;
+typedef std::queue<TNMessagePtr> TNMessageQueue;
 
-                service.sin_family      = AF_INET;
-                service.sin_port        = htons( port );
-                service.sin_addr.s_addr = inet_addr( address );
 
-                if ( service.sin_addr.s_addr == INADDR_NONE )
-                {
-                    hostent* pHost = gethostbyname( address );
-                    std::memcpy( &service.sin_addr.s_addr, pHost->h_addr, pHost->h_length );
-                    service.sin_family = pHost->h_addrtype;
-                }
+enum TNPlacement
+{
+    TNPlacement_None, // the OS schedules the I/O threads freely
+    TNPlacement_Core, // each connection's receive thread stays on one CPU
+    TNPlacement_Node  // each connection's receive thread stays on one NUMA node
+};
 
-                int connectResult = connect( serverSocket, (sockaddr*)&service, sizeof(service) );
-                if ( connectResult == 0 )
-                {
-                    TNConnectionPtr pConnection( new TNConnection(this, serverSocket, 0) );
-                    pConnection->Start();
-                    m_pServer = pConnection;
+// TNThreadConfig : How a node starts the receive thread of each connection.
+// Connections are spread over the CPUs (or nodes) round robin by ID. As the
+// receive thread allocates the receive buffers and messages of its
+// connection, they come from memory local to that CPU/node.
+struct TNThreadConfig
+{
+    TNPlacement   Placement;
+    TNCpuSet      Cpus;       // CPUs to place on; empty: all the process may use
+    std::size_t   uStackSize; // 0: platform default
+    TNSchedPolicy Policy;
+    int           iPriority;
+
+    TNThreadConfig()
+        : Placement(TNPlacement_None)
+        , Cpus()
+        , uStackSize(0)
+        , Policy(TNSched_Default)
+        , iPriority(0)
+        {}
+};
 
-                    result = true;
-                }
-                else
-                {
-                    assert( !"TelnetClient::Connect : connect != 0" );
-                }
 
-                if ( result == false )
-                {
-                    closesocket( serverSocket );
-                }
-            }
-            else
-            {
-                assert( !"TelnetClient::Connect : serverSocket == TNSocketHandle_Invalid" );
-            }
+// TNTlsConfig : TLS settings of a node (see TelnetNode::SetTls). Files are
+// PEM encoded.
+// * A server needs a certificate and its key; with a CA file it also
+//   requires a client certificate signed by it
+// * A client verifies the server against the CA file, if given, and checks
+//   that the certificate matches ServerName (default: the Connect address)
+struct TNTlsConfig
+{
+    std::string CertificateFile;    // certificate chain, leaf first
+    std::string PrivateKeyFile;
+    std::string CaFile;             // CAs to verify the peer with; empty: the system's (client),
+                                    // no client certificates (server)
+    std::string ServerName;         // client: SNI and the name to verify
+    bool        bVerifyPeer;        // false: accept any certificate (for testing only)
+    bool        bSessionResumption; // session tickets, so that reconnects skip the full handshake
+    bool        bKernelOffload;     // kernel TLS (kTLS) for sends where the OS and OpenSSL support it
+
+    TNTlsConfig()
+        : CertificateFile()
+        , PrivateKeyFile()
+        , CaFile()
+        , ServerName()
+        , bVerifyPeer(true)
+        , bSessionResumption(true)
+        , bKernelOffload(true)
+        {}
+};
 
-            return result;
+// TNTlsStats : Completed TLS handshakes of a node
+struct TNTlsStats
+{
+    unsigned long long uHandshakes;
+    unsigned long long uResumed;       // of those, abbreviated by session resumption
+    unsigned long long uKernelOffload; // of those, sending through kTLS
+
+    TNTlsStats()
+        : uHandshakes(0)
+        , uResumed(0)
+        , uKernelOffload(0)
+        {}
+};
+
+
+class TNConnection;
+class TNTopicTrie;
+class TNCompressorPool;
+class TNTlsContext;
+class TNWriter;
+
+
+// TelnetNode : The public interface
+class TelnetNode
+{
+public:
+
+    static int Initialize();
+    static void Finalize();
+
+    static TelnetNode* CreateServer( unsigned int port = 23 );
+    static TelnetNode* CreateClient( const char* address = "LOCALHOST", unsigned int port = 23 );
+
+    // The same over a transport URI:
+    //   tcp://host:port   TCP; a server binds to host ('*' or empty: any address)
+    //   unix:///path      Unix domain socket (not on Windows)
+    //   inproc://name     within this process; no port, file or privilege
+    //                     needed. A client connects to a server of this
+    //                     process listening on the same name
+    static TelnetNode* CreateServerUri( const char* uri );
+    static TelnetNode* CreateClientUri( const char* uri );
+    static void ReleaseNode( TelnetNode* pNode )
+        { delete pNode; }
+
+    virtual bool IsServer() =0;
+
+    // Sends at once unless the calling thread has a TNSendBatch open on this
+    // node.
+    virtual bool SendText( const char* pText, unsigned int uClient = 0 ) =0;
+
+    // Formats text for uClient without a copy of its own and sends like SendText
+    // when the writer goes out of scope (see TNWriter):
+    //   pNode->Writer( uClient ) << "rows: " << n << '\n';
+    TNWriter Writer( unsigned int uClient = 0 );
+
+    // Sends everything held back for uClient (0: all peers).
+    virtual bool Flush( unsigned int uClient = 0 ) =0;
+
+    // While the calling thread has a batch open on this node, its SendText
+    // only buffers; the data leaves in one send per peer when its outermost
+    // batch ends (or when a peer's buffer fills up), and only the peers it
+    // wrote to are flushed. Other threads are not affected. See TNSendBatch.
+    void BeginBatch();
+    void EndBatch();
+    bool IsBatching();
+
+    // Binary side channel: the payload is delivered as one TNMessage_Frame
+    // message, interleaved in order with the lines sent by SendText. The
+    // receiving node must accept frames (TNReceiveConfig::bFrames).
+    virtual bool SendFrame( unsigned short uTag, const void* pData, std::size_t uSize, unsigned int uClient = 0 ) =0;
+
+    // Sends a POD value as is (host byte order and layout on both ends).
+    template <typename T>
+    bool SendStruct( unsigned short uTag, const T& value, unsigned int uClient = 0 )
+        { return SendFrame( uTag, &value, sizeof(T), uClient ); }
+
+    template <typename T>
+    bool SendArray( unsigned short uTag, const T* pValues, std::size_t uCount, unsigned int uClient = 0 )
+        { return SendFrame( uTag, pValues, uCount * sizeof(T), uClient ); }
+
+    void PushReceivedText( TNTextPtr pText, unsigned int uClient = 0 );
+    void PushReceivedMessage( TNMessagePtr pMsg );
+
+    // Blocks until a message is queued, WakeReceiver is called or the time
+    // is up. Returns true if messages are queued.
+    bool WaitReceivedText( unsigned int uTimeoutMs );
+
+    void WakeReceiver()
+        { m_MessageEvent.Set(); }
+
+    // When enabled, connects and disconnects are queued as TNMessage_Connect
+    // and TNMessage_Disconnect messages (empty Text). Disconnect follows the
+    // last data of that client.
+    void SetConnectionEvents( bool bEnable );
+    bool IsConnectionEventsEnabled();
+    void PushConnectionEvent( TNMessageType type, unsigned int uClient );
+
+    // Closes the connection to uClient without waiting; its receive side
+    // ends as if the peer had hung up.
+    virtual void Disconnect( unsigned int uClient = 0 ) =0;
+
+    void DeleteReceivedText( TNMessagePtr pUnusedMsg )
+        { delete pUnusedMsg; }
+
+    TNMessagePtr PopReceivedText();
+
+    // Applies to connections established after the call.
+    void SetTimeouts( const TNTimeoutConfig& config );
+    TNTimeoutConfig GetTimeouts();
+
+    // Applies to connections established after the call.
+    void SetReceiveConfig( const TNReceiveConfig& config );
+    TNReceiveConfig GetReceiveConfig();
+
+    // Applies to connections established after the call.
+    void SetThreadConfig( const TNThreadConfig& config );
+    TNThreadConfig GetThreadConfig();
+
+    // The CPUs the receive thread of uClient is kept on; empty without a
+    // placement. Pin the thread handling uClient's messages to the same set
+    // (TNThread::SetAffinity) to keep the whole path on one core or node.
+    TNCpuSet GetPlacement( unsigned int uClient );
+
+    // Name, stack, scheduling and placement for uClient's receive thread.
+    TNThreadAttributes ReceiveThreadAttributes( unsigned int uClient );
+
+    // Outbound compression with Telnet MCCP2 (option 86). A server offers it
+    // to every new connection, a client accepts the offer. Returns false when
+    // built without TN_ENABLE_MCCP. Applies to connections established after
+    // the call.
+    bool SetCompression( bool bEnable );
+    bool IsCompressionEnabled();
+
+#if defined(TN_ENABLE_MCCP)
+    TNCompressorPool& Compressors()
+        { return *m_pCompressors; }
+#endif
+
+    // TLS (OpenSSL) under the Telnet stream. Returns false when built
+    // without TN_ENABLE_TLS or when the files in config cannot be loaded.
+    // Applies to connections established after the call; a client's Connect
+    // then returns once the handshake has succeeded.
+    bool SetTls( bool bEnable, const TNTlsConfig& config = TNTlsConfig() );
+    bool IsTlsEnabled();
+    TNTlsStats GetTlsStats();
+
+#if defined(TN_ENABLE_TLS)
+    TNTlsContext& Tls()
+        { return *m_pTls; }
+#endif
+
+    // All timers of a node share one wheel driven by a single timer thread,
+    // which is started on first use. Callbacks run on that thread with the
+    // wheel locked; they must not block and may only re-arm via the wheel.
+    void ArmTimer( TNTimer* pTimer, unsigned int uDelayMs );
+    void DisarmTimer( TNTimer* pTimer );
+
+protected:
+
+    TelnetNode();
+    virtual ~TelnetNode();
+    TelnetNode& operator=( const TelnetNode& other );
+    void StopTimers();
+
+    // The connection to uClient with a reference for the caller, or NULL
+    // (uClient 0 on a server: there is more than one).
+    virtual TNConnection* AcquireConnection( unsigned int uClient ) =0;
+
+    // Called by the receive thread of pConnection when it ends.
+    virtual void ConnectionClosed( TNConnection* pConnection ) =0;
+
+    // True while the calling thread has a batch open; uClient is then
+    // flushed when the batch ends instead of right away.
+    bool HoldBack( unsigned int uClient );
+
+private:
+
+    friend class TNConnection;
+    friend class TNWriter;
+
+    static TNThread::RetVal TNAPI TimerThreadEntry( void* arg );
+    void TimerThread();
+
+    TNMutex           m_MessageMutex;
+    TNMessageQueue    m_Messages;
+    TNEvent           m_MessageEvent;
+    bool              m_bReceiverWaiting;
+
+    TNMutex           m_TimerMutex;
+    TNTimerWheel      m_Timers;
+    TNThread          m_TimerThread;
+    bool              m_bTimerRunning;
+    TNEvent           m_TimerEvent;       // wakes the timer thread early
+    unsigned long long m_uTimerWake;      // tick it sleeps until; ~0: until armed
+
+    TNMutex           m_ConfigMutex;
+    TNTimeoutConfig   m_Timeouts;
+    TNReceiveConfig   m_Receive;
+    TNThreadConfig    m_ThreadConfig;
+    TNCpuSetList      m_Placement; // one set per CPU or node; empty: no placement
+    bool              m_bCompression;
+    bool              m_bConnectionEvents;
+    TNCompressorPool* m_pCompressors; // NULL without TN_ENABLE_MCCP
+    TNTlsContext*     m_pTls;         // NULL without TN_ENABLE_TLS
+}; // End : TelnetNode
+
+
+// TNSendBatch : Scope guard for TelnetNode::BeginBatch/EndBatch.
+//   {
+//       TNSendBatch batch( pNode );
+//       for ( ... ) pNode->SendText( row );  // coalesced
+//   }                                        // flushed here
+class TNSendBatch
+{
+public:
+    explicit TNSendBatch( TelnetNode* pNode )
+        : m_pNode(pNode)
+        {
+            if ( m_pNode != NULL )
+                m_pNode->BeginBatch();
         }
 
-    void Close()
+    ~TNSendBatch()
         {
-            if ( m_pServer != NULL )
-            {
-                m_pServer->Close();
-                delete m_pServer;
-            }
+            if ( m_pNode != NULL )
+                m_pNode->EndBatch();
         }
 
 private:
 
-    TNConnectionPtr m_pServer;
-}; // End : TelnetClient
+    TNSendBatch( const TNSendBatch& other );
+    TNSendBatch& operator=( const TNSendBatch& other );
+
+    TelnetNode* m_pNode;
+};
 
 
-// TelnetServer : Provides the server-specific implementation (Listen, etc.)
-class TelnetServer : public TelnetNode
+// TNWriter : Streams text into a buffer recycled by the connection, without
+// an intermediate string, and sends it when destroyed (or on Commit) the way
+// SendText would: at once, or with the open TNSendBatch.
+//   {
+//       TNWriter out = pNode->Writer( uClient );
+//       out << "rows: " << n << '\n';
+//       out.Printf( "%-16s %8.2f\n", name, value );
+//   }
+// Formatting takes no lock; the send lock is held only while Commit hands
+// the text over, so other sends to the client may go on meanwhile. Each
+// Commit arrives whole, in the order committed, which is not the order of
+// writing: inside a batch as outside,
+//   pNode->SendText( "one\n", uClient );
+//   TNWriter out = pNode->Writer( uClient );
+//   out << "two\n";
+//   pNode->SendText( "three\n", uClient );   // arrives before "two"
+// Commit the writer before sending to its client by other means to keep
+// the lines in the order they were written. When nothing else is
+// buffered the text becomes the send buffer without a copy. A server writer
+// for client 0 formats once and sends it to everyone; one for an unknown
+// client discards the text. Like SendText, Telnet IAC bytes are doubled.
+class TNWriter
 {
 public:
-    TelnetServer()
-        : m_ListenThread()
-        , m_ListenSocket(TNSocketHandle_Invalid)
-        , m_ListenSocketMutex()
-        , m_uClientCreatedCount(0)
-        , m_Clients()
-        {}
+    TNWriter( TelnetNode* pNode, unsigned int uClient );
 
-    virtual ~TelnetServer()
-        {
-            Close();
-        }
+    // Takes over other's text; other is left empty (C++03 has no move).
+    TNWriter( const TNWriter& other );
 
-    virtual bool IsServer()
-        { return true; }
+    ~TNWriter();
 
-    virtual bool SendText( const char* pText, unsigned int uClient = 0 )
+    // Sends what has been written so far. The writer stays usable. Returns
+    // false if sending failed or the client is unknown.
+    bool Commit();
+
+    TNWriter& Write( const char* pData, std::size_t uSize )
         {
-            const unsigned int rawBufSize = 8192;
-            char rawBuffer[rawBufSize];
-            snprintf( rawBuffer, 8192, "%s", pText );
-            std::size_t length = std::strlen( rawBuffer );
+            m_pBuffer->insert( m_pBuffer->end(), pData, pData + uSize );
+            return *this;
+        }
 
-            bool result = true;
-            if ( uClient == 0 )
-            {
-                for ( TNConnectionMap::iterator it = m_Clients.begin(); it != m_Clients.end(); ++it )
-                {
-                    TNConnectionPtr pClient = (*it).second;
-                    bool done = pClient->Send( rawBuffer, length );
-                    if ( !done )
-                        result = false;
-                }
-            }
-            else
-            {
-                TNConnectionMap::iterator it = m_Clients.find( uClient );
-                if ( it != m_Clients.end() )
-                {
-                    TNConnectionPtr pClient = (*it).second;
-                    result = pClient->Send( rawBuffer, length );
-                }
-            }
+    TNWriter& operator<<( const char* pText )
+        { return Write( pText, std::strlen( pText ) ); }
 
-            return result;
-        }
+    TNWriter& operator<<( const std::string& text )
+        { return Write( text.data(), text.size() ); }
 
-    bool Listen( unsigned int port = 23 )
+    TNWriter& operator<<( char c )
         {
-            bool result = false;
+            m_pBuffer->push_back( c );
+            return *this;
+        }
 
-            Close();
-            m_ListenThread.Invalidate();
+    TNWriter& operator<<( int value )
+        { return *this << (long long)value; }
 
-            m_ListenSocket = socket( AF_INET, SOCK_STREAM, IPPROTO_TCP );
-            if ( m_ListenSocket != TNSocketHandle_Invalid )
-            {
-                sockaddr_in service = { 0 };
+    TNWriter& operator<<( unsigned int value )
+        { return *this << (unsigned long long)value; }
 
-                service.sin_family      = AF_INET;
-                service.sin_port        = htons( port );
-                service.sin_addr.s_addr = htonl( INADDR_ANY );
+    TNWriter& operator<<( long value )
+        { return *this << (long long)value; }
 
-                int bindResult = bind( m_ListenSocket, (sockaddr*)&service, sizeof(service) );
-                if ( bindResult == 0 )
-                {
-                    int listenResult = listen( m_ListenSocket, SOMAXCONN );
-                    if ( listenResult == 0 )
-                    {
-                        m_ListenThread.Run( ListenThreadEntry, this );
-                    }
-                    else
-                    {
-                        assert( !"TelnetServer::Listen : listen != 0" );
-                    }
-                }
-                else
-                {
-                    assert( !"TelnetServer::Listen : bind != 0" );
-                }
+    TNWriter& operator<<( unsigned long value )
+        { return *this << (unsigned long long)value; }
 
-                if ( !m_ListenThread.IsInvalid() )
-                {
-                    result = true;
-                }
-            }
-            else
+    TNWriter& operator<<( long long value )
+        {
+#if defined(TN_HAS_TO_CHARS)
+            return ToChars( value );
+#else
+            if ( value >= 0 )
+                return *this << (unsigned long long)value;
+
+            m_pBuffer->push_back( '-' );
+            return *this << (0ULL - (unsigned long long)value);
+#endif
+        }
+
+    TNWriter& operator<<( unsigned long long value )
+        {
+#if defined(TN_HAS_TO_CHARS)
+            return ToChars( value );
+#else
+            char digits[20];
+            char* pDigit = digits + sizeof(digits);
+            do
             {
-                assert( !"TelnetServer::Listen : m_ListenSocket == TNSocketHandle_Invalid" );
-            }
+                *--pDigit = (char)('0' + value % 10);
+                value /= 10;
+            } while ( value != 0 );
 
-            return result;
+            return Write( pDigit, digits + sizeof(digits) - pDigit );
+#endif
+        }
+
+    // Text that reads back as the same value: the shortest one, or %.15g
+    // (%.17g if that loses precision) where the standard library lacks
+    // floating point std::to_chars.
+    TNWriter& operator<<( double value )
+        {
+#if defined(TN_HAS_TO_CHARS)
+            return ToChars( value );
+#else
+            char text[32];
+            int length = TN_SNPRINTF( text, sizeof(text), "%.15g", value );
+            if ( std::strtod( text, NULL ) != value )
+                length = TN_SNPRINTF( text, sizeof(text), "%.17g", value );
+            return Write( text, (length > 0) ? (std::size_t)length : 0 );
+#endif
         }
 
-    void Close()
+    // printf formatting, straight into the writer's buffer.
+    TNWriter& Printf( const char* pFormat, ... )
         {
-            for ( TNConnectionMap::iterator it = m_Clients.begin(); it != m_Clients.end(); ++it )
+            std::size_t used = m_pBuffer->size();
+            va_list args;
+#if defined(_MSC_VER) && _MSC_VER < 1900
+            // _vsnprintf does not tell the length it needs; measure first
+            va_start( args, pFormat );
+            int length = _vscprintf( pFormat, args );
+            va_end( args );
+
+            if ( length > 0 )
             {
-                TNConnectionPtr pClient = (*it).second;
-                pClient->Close();
+                m_pBuffer->resize( used + length + 1 );
+                va_start( args, pFormat );
+                _vsnprintf( &(*m_pBuffer)[used], length + 1, pFormat, args );
+                va_end( args );
             }
+#else
+            std::size_t room = m_pBuffer->capacity() - used;
+            if ( room < 128 )
+                room = 128;
+            m_pBuffer->resize( used + room );
 
-            if ( m_ListenSocket != TNSocketHandle_Invalid )
-            {
-                m_ListenSocketMutex.Lock();
-                closesocket( m_ListenSocket );
-                m_ListenSocket = TNSocketHandle_Invalid;
-                m_ListenSocketMutex.Unlock();
+            va_start( args, pFormat );
+            int length = std::vsnprintf( &(*m_pBuffer)[used], room, pFormat, args );
+            va_end( args );
 
-                m_ListenThread.Join();
-                m_ListenThread.Invalidate();
+            if ( length >= 0 && (std::size_t)length >= room )
+            {
+                m_pBuffer->resize( used + length + 1 );
+                va_start( args, pFormat );
+                std::vsnprintf( &(*m_pBuffer)[used], length + 1, pFormat, args );
+                va_end( args );
             }
+#endif
+            m_pBuffer->resize( used + ((length > 0) ? length : 0) );
 
+            return *this;
         }
 
 private:
 
-    static TNThread::RetVal TNAPI ListenThreadEntry( void* arg )
+    TNWriter& operator=( const TNWriter& other );
+
+#if defined(TN_HAS_TO_CHARS)
+    template <typename T>
+    TNWriter& ToChars( T value )
         {
-            ((TelnetServer*)arg)->ListenThread();
-            TNThread::Exit();
+            const std::size_t MaxLength = 32; // any integer; a double in shortest form
+            std::size_t used = m_pBuffer->size();
+            m_pBuffer->resize( used + MaxLength );
+
+            char* pBegin = &(*m_pBuffer)[used];
+            std::to_chars_result result = std::to_chars( pBegin, pBegin + MaxLength, value );
+            m_pBuffer->resize( used + (result.ptr - pBegin) );
 
-            return 0;
+            return *this;
         }
+#endif
 
-    void ListenThread()
-        {
-            bool done = false;
+    // Sends; with bReopen the writer stays usable.
+    bool Finish( bool bReopen );
 
-            m_ListenSocketMutex.Lock();
-            TNSocketHandle listenSocket = m_ListenSocket;
-            done = (listenSocket == TNSocketHandle_Invalid);
-            m_ListenSocketMutex.Unlock();
+    TelnetNode*                m_pNode;
+    unsigned int               m_uClient;
+    mutable TNConnection*      m_pConnection; // referenced; NULL: m_Scratch
+    mutable std::vector<char>* m_pBuffer;     // the connection's, or m_Scratch; NULL once taken over
+    mutable std::vector<char>  m_Scratch;
+}; // End : TNWriter
 
-            while ( !done )
-            {
-                TNSocketHandle clientSocket = TNSocketHandle_Invalid;
-                clientSocket = accept( listenSocket, NULL, NULL );
-                if ( clientSocket != TNSocketHandle_Invalid )
-                {
-                    unsigned int uClientID = ++m_uClientCreatedCount;
-                    TNConnectionPtr pConnection( new TNConnection(this, clientSocket, uClientID) );
-                    pConnection->Start();
-                    m_Clients[uClientID] = pConnection;
-                }
 
-                m_ListenSocketMutex.Lock();
-                listenSocket = m_ListenSocket;
-                done = (listenSocket == TNSocketHandle_Invalid);
-                m_ListenSocketMutex.Unlock();
-            }
+// TNTrafficStats : Outbound counters of a connection
+struct TNTrafficStats
+{
+    unsigned long long uBytesSent; // on the wire, after compression
+    unsigned long long uSendCalls; // 'send' system calls
 
-            for ( TNConnectionMap::iterator it = m_Clients.begin(); it != m_Clients.end(); ++it )
-            {
-                TNConnectionPtr pConnection = (*it).second;
-                if ( pConnection )
-                {
-                    pConnection->Close();
-                    delete pConnection;
-                }
-            }
-            m_Clients.clear();
-        }
+    TNTrafficStats()
+        : uBytesSent(0)
+        , uSendCalls(0)
+        {}
+};
 
-    TNThread        m_ListenThread;
-    TNSocketHandle  m_ListenSocket;
-    TNMutex         m_ListenSocketMutex;
-    unsigned int    m_uClientCreatedCount;
-    TNConnectionMap m_Clients;
-}; // End : TelnetServer
 
+typedef TNConnection* TNConnectionPtr;
+typedef std::map<unsigned int, TNConnectionPtr> TNConnectionMap;
+typedef std::vector<TNConnectionPtr> TNConnectionList;
 
 
-// static
-inline int TelnetNode::Initialize()
-{
-    int result = 0;
-#if defined(TNPLATFORM_WINDOWS)
-    WSADATA wsaData;
-    WORD wVersion = MAKEWORD( 2, 2 );
-    result = WSAStartup( wVersion, &wsaData );
-    if ( result != 0 )
-    {
-        WSACleanup();
-    }
-#endif // defined(TNPLATFORM_WINDOWS)
-    return result;
-}
-
-// static
-inline void TelnetNode::Finalize()
+// TNShutdownStats : What TelnetServer::Shutdown managed to deliver
+struct TNShutdownStats
 {
-#if defined(TNPLATFORM_WINDOWS)
-    WSACleanup();
-#endif // defined(TNPLATFORM_WINDOWS)
-}
+    unsigned int       uConnections;
+    unsigned long long uBytesFlushed; // sent during Shutdown and not discarded
+    unsigned long long uBytesDropped; // buffered or queued when the deadline passed
+
+    TNShutdownStats()
+        : uConnections(0)
+        , uBytesFlushed(0)
+        , uBytesDropped(0)
+        {}
+};
+
 
-// static
-inline TelnetNode* TelnetNode::CreateServer( unsigned int port )
+// TelnetClient : Provides the client-specific implementation (Connect, etc.)
+class TelnetClient : public TelnetNode
 {
-    TelnetServer* pServer = new TelnetServer;
+public:
+    TelnetClient();
+    virtual ~TelnetClient();
 
-    bool listenSucceeded = pServer->Listen( port );
-    if ( !listenSucceeded )
-    {
-        delete pServer;
-        return NULL;
-    }
+    virtual bool IsServer()
+        { return false; }
 
-    return pServer;
-}
+    virtual bool SendText( const char* pText, unsigned int /*uClient*/ = 0 );
+    virtual bool Flush( unsigned int /*uClient*/ = 0 );
+    virtual bool SendFrame( unsigned short uTag, const void* pData, std::size_t uSize, unsigned int /*uClient*/ = 0 );
+    virtual void Disconnect( unsigned int /*uClient*/ = 0 );
+    bool Connect( const char* address = "LOCALHOST", unsigned int port = 23 );
+    bool ConnectUri( const char* uri ); // see TelnetNode::CreateClientUri
+    void Close();
 
-// static
-inline TelnetNode* TelnetNode::CreateClient( const char* address, unsigned int port )
+protected:
+
+    virtual TNConnectionPtr AcquireConnection( unsigned int uClient );
+    virtual void ConnectionClosed( TNConnectionPtr /*pConnection*/ )
+        {}
+
+private:
+
+    // Starts a connection on a connected socket, which it then owns.
+    bool Attach( TNSocketHandle hSocket, const char* pPeerName );
+
+    TNConnectionPtr m_pServer;
+}; // End : TelnetClient
+
+
+// TelnetServer : Provides the server-specific implementation (Listen, etc.)
+class TelnetServer : public TelnetNode
 {
-    TelnetClient* pClient = new TelnetClient;
+public:
+    TelnetServer();
+    virtual ~TelnetServer();
 
-    bool connectSucceeded = pClient->Connect( address, port );
-    if ( !connectSucceeded )
-    {
-        delete pClient;
-        return NULL;
-    }
+    virtual bool IsServer()
+        { return true; }
+
+    virtual bool SendText( const char* pText, unsigned int uClient = 0 );
+    virtual bool Flush( unsigned int uClient = 0 );
+    virtual bool SendFrame( unsigned short uTag, const void* pData, std::size_t uSize, unsigned int uClient = 0 );
+
+    // uClient 0 is ignored; use Close or Shutdown to drop everyone.
+    virtual void Disconnect( unsigned int uClient );
+
+    // Topic channels: Publish reaches only the clients whose patterns match.
+    // In a pattern '*' is one dot-separated segment; a trailing '**' is zero
+    // or more, so "net.**" matches "net" too.
+    bool Subscribe( unsigned int uClient, const char* pPattern );
+    bool Unsubscribe( unsigned int uClient, const char* pPattern );
+
+    // Returns false if sending failed for a subscriber; publishing to a topic
+    // without subscribers succeeds.
+    bool Publish( const char* pTopic, const char* pText );
+
+    // Handles the console commands "subscribe <pattern>" and
+    // "unsubscribe <pattern>", replying with "ok" or "error". Returns false
+    // (and leaves the message alone) for any other message.
+    bool HandleTopicCommand( TNMessagePtr pMsg );
+
+    // Outbound counters of uClient (0: all current clients).
+    TNTrafficStats GetTrafficStats( unsigned int uClient = 0 );
+
+    bool Listen( unsigned int port = 23 );
+    bool ListenUri( const char* uri ); // see TelnetNode::CreateServerUri
+
+    // Serves a connected socket as a new client, as if it had been accepted.
+    // The server owns the socket from then on. Returns the client ID.
+    unsigned int Accept( TNSocketHandle hSocket );
+
+    // Closes immediately; the kernel keeps sending queued data in background.
+    void Close();
+
+    // Stops accepting, gives every connection up to uDrainMs to get its send
+    // queue acknowledged, then resets whatever is left. All connections are
+    // drained and woken together, so the time taken does not grow with the
+    // number of clients.
+    TNShutdownStats Shutdown( unsigned int uDrainMs );
+
+protected:
+
+    virtual TNConnectionPtr AcquireConnection( unsigned int uClient );
+
+    // Drops the connection from the clients at once. Its receive thread
+    // cannot join itself, so the timer thread closes the connection on its
+    // next tick, or Shutdown does.
+    virtual void ConnectionClosed( TNConnectionPtr pConnection );
+
+private:
+
+    static TNThread::RetVal TNAPI ListenThreadEntry( void* arg );
+    void ListenThread();
+    void StopListening();
+
+    // Binds hSocket to the address and starts the listen thread. Closes
+    // hSocket on failure.
+    bool ListenOn( TNSocketHandle hSocket, const void* pAddress, unsigned int uAddressSize );
+
+    // Collects referenced connections so that sending, which may block, can
+    // happen outside m_ClientsMutex. The caller releases them.
+    void AcquireTargets( unsigned int uClient, TNConnectionList& targets );
+
+    // Writes to every target and releases them.
+    bool WriteAll( TNConnectionList& targets, const char* pText );
+
+    static void ReapTimerCallback( TNTimerWheel& wheel, TNTimer* pTimer, void* arg );
+
+    TNThread        m_ListenThread;
+    TNSocketHandle  m_ListenSocket;
+    TNMutex         m_ListenSocketMutex;
+    std::string     m_UnixPath;   // removed when listening stops
+    std::string     m_InprocName; // registered while listening
+    unsigned int    m_uClientCreatedCount;
+    TNMutex         m_ClientsMutex;
+    TNConnectionMap m_Clients;
+    TNConnectionList m_Closed;  // ended; closed by m_ReapTimer
+    TNTimer         m_ReapTimer;
+    TNMutex         m_TopicMutex;
+    TNTopicTrie*    m_pTopics;
+}; // End : TelnetServer
 
-    return pClient;
-}
 
 #endif // TELNETNODE_H_INCLUDED
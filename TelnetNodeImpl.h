@@ -0,0 +1,2232 @@
+// -*- mode: C++; coding: utf-8-unix -*-
+#ifndef TELNETNODEIMPL_H_INCLUDED
+#define TELNETNODEIMPL_H_INCLUDED
+
+// TelnetNodeImpl.h : Internals of the telnetnode library. Included by
+// TelnetNode.cpp only; applications include TelnetNode.h.
+
+#include "TelnetNode.h"
+
+#include <cstdlib>
+
+#if defined(TNPLATFORM_UNIX)
+#  include <sys/types.h>
+#  include <sys/socket.h>
+#  include <sys/uio.h>
+#  include <arpa/inet.h>
+#  include <poll.h>
+#  include <netinet/in.h>
+#  include <netinet/tcp.h>
+#  include <netdb.h>
+#  include <sys/ioctl.h>
+#  include <sys/stat.h>
+#  include <sys/un.h>
+#  include <sched.h>
+#elif defined(TNPLATFORM_WINDOWS)
+#  pragma warning(disable: 4996) // suppress security warnings
+#endif
+
+#if defined(TNPLATFORM_UNIX)
+#  define TNSocketHandle_Invalid -1
+#  define TNSocketShutdown_Send SHUT_WR
+#  define TNSocketShutdown_Both SHUT_RDWR
+#  define closesocket(socket_handle) close((socket_handle))
+#  if defined(MSG_NOSIGNAL)
+#    define TNSocket_SendFlags MSG_NOSIGNAL
+#  else
+#    define TNSocket_SendFlags 0 // SO_NOSIGPIPE is set per socket instead
+#  endif
+#  define TNSocket_DontWait MSG_DONTWAIT
+#elif defined(TNPLATFORM_WINDOWS)
+#  define TNSocketHandle_Invalid INVALID_SOCKET
+#  define TNSocketShutdown_Send 0x01 // SD_SEND
+#  define TNSocketShutdown_Both 0x02 // SD_BOTH
+#  define TNSocket_SendFlags 0
+#  define TNSocket_DontWait 0 // sockets are blocking; best effort only
+#  pragma comment(lib, "wsock32.lib")
+#endif
+
+
+#if defined(TN_ENABLE_MCCP)
+#  include <zlib.h>
+#endif
+
+#if defined(TN_ENABLE_TLS)
+#  include <openssl/ssl.h>
+#  include <openssl/err.h>
+#  include <openssl/x509v3.h>
+#endif
+
+
+// TNUri : A transport URI (see TelnetNode::CreateServerUri)
+struct TNUri
+{
+    enum Scheme
+    {
+        Scheme_Invalid,
+        Scheme_Tcp,    // tcp://host:port; a server binds to host ('*' or empty: any)
+        Scheme_Unix,   // unix:///path/to/socket
+        Scheme_Inproc  // inproc://name
+    };
+
+    Scheme       Type;
+    std::string  Host; // tcp
+    unsigned int Port; // tcp
+    std::string  Path; // unix: the socket file; inproc: the name
+
+    TNUri()
+        : Type(Scheme_Invalid)
+        , Host()
+        , Port(0)
+        , Path()
+        {}
+
+    static TNUri Parse( const char* pUri )
+        {
+            TNUri result;
+            std::string uri = (pUri != NULL) ? pUri : "";
+
+            if ( uri.compare(0, 6, "tcp://") == 0 )
+            {
+                std::string authority = uri.substr( 6 );
+                std::string::size_type colon = authority.rfind( ':' );
+                if ( colon == std::string::npos || colon + 1 == authority.size() )
+                    return result;
+                for ( std::string::size_type i = colon + 1; i < authority.size(); ++i )
+                {
+                    if ( authority[i] < '0' || authority[i] > '9' )
+                        return result;
+                }
+
+                result.Host = authority.substr( 0, colon );
+                result.Port = (unsigned int)std::strtoul( authority.c_str() + colon + 1, NULL, 10 );
+                if ( result.Port <= 65535 )
+                    result.Type = Scheme_Tcp;
+            }
+            else if ( uri.compare(0, 7, "unix://") == 0 && uri.size() > 7 )
+            {
+                result.Path = uri.substr( 7 );
+                result.Type = Scheme_Unix;
+            }
+            else if ( uri.compare(0, 9, "inproc://") == 0 && uri.size() > 9 )
+            {
+                result.Path = uri.substr( 9 );
+                result.Type = Scheme_Inproc;
+            }
+
+            return result;
+        }
+}; // End : TNUri
+
+
+// Telnet commands (RFC 854) understood by TNReceiveBuffer
+enum TNTelnetCommand
+{
+    TNTelnet_SE   = 240,
+    TNTelnet_NOP  = 241,
+    TNTelnet_SB   = 250,
+    TNTelnet_WILL = 251,
+    TNTelnet_WONT = 252,
+    TNTelnet_DO   = 253,
+    TNTelnet_DONT = 254,
+    TNTelnet_IAC  = 255
+};
+
+// Telnet options negotiated by TNConnection
+enum TNTelnetOption
+{
+    TNTelnetOption_Compress2 = 86, // MCCP2
+    TNTelnetOption_Frame     = 201 // private: binary frame, see TNMessage_Frame
+};
+
+
+// TNTelnetEvent : An option negotiation found in the incoming stream
+struct TNTelnetEvent
+{
+    unsigned char Command; // WILL, WONT, DO, DONT or SB (subnegotiation completed)
+    unsigned char Option;
+};
+
+typedef std::queue<TNTelnetEvent> TNTelnetEventQueue;
+
+
+// TNReceiveBuffer :
+// * Stocks 'recv'ed data
+// * Strips Telnet commands and reports option negotiations
+// * Splits data into lines of text
+class TNReceiveBuffer
+{
+public:
+    typedef std::vector<char> RawBuffer;
+
+    explicit TNReceiveBuffer( const TNReceiveConfig& config, unsigned int uInitialSize = 8192 )
+        : m_Config(config)
+        , m_State(State_Data)
+        , m_uVerb(0)
+        , m_uHeaderBytes(0)
+        , m_pFrame(NULL)
+        , m_uFrameCapacity(0)
+        , m_uFrameSize(0)
+        , m_uFrameBytes(0)
+        , m_uFrameTag(0)
+        , m_bError(false)
+        {
+            m_Buffer.reserve( uInitialSize );
+        }
+
+    ~TNReceiveBuffer()
+        {
+            delete [] m_pFrame;
+            while ( !m_Messages.empty() )
+            {
+                delete m_Messages.front();
+                m_Messages.pop();
+            }
+        }
+
+    bool Empty()
+        {
+            return m_Messages.empty();
+        }
+
+    // True after a malformed frame or a line over the limit; the stream
+    // cannot be resynchronized.
+    bool HasError()
+        {
+            return m_bError;
+        }
+
+    // True while an incomplete line is waiting for its '\n'.
+    bool HasPartial()
+        {
+            return !m_Buffer.empty();
+        }
+
+    // Lines and frames in arrival order. ID is left 0 for the caller to set.
+    TNMessagePtr GetMessage()
+        {
+            TNMessagePtr result = NULL;
+            if ( !m_Messages.empty() )
+            {
+                result = m_Messages.front();
+                m_Messages.pop();
+            }
+
+            return result;
+        }
+
+    bool GetEvent( TNTelnetEvent& event )
+        {
+            if ( m_Events.empty() )
+                return false;
+
+            event = m_Events.front();
+            m_Events.pop();
+
+            return true;
+        }
+
+    // Returns the number of bytes consumed. Parsing stops right after a
+    // subnegotiation that changes the stream encoding (MCCP2), so that the
+    // caller can decode the remaining bytes before handing them back.
+    unsigned int Append( const char* pBuffer, unsigned int uBufferSize )
+        {
+            if ( !pBuffer || uBufferSize == 0 )
+                return 0;
+
+            // stock
+            const char* pBegin = pBuffer;
+            const char* pEnd = pBuffer + uBufferSize;
+            bool encodingChanged = false;
+            while ( pBuffer < pEnd && !encodingChanged && !m_bError )
+            {
+                if ( m_State == State_FramePayload || m_State == State_FrameSkip )
+                {
+                    unsigned int length = std::min<unsigned int>( m_uFrameSize - m_uFrameBytes, pEnd - pBuffer );
+                    if ( m_State == State_FramePayload )
+                    {
+                        ReserveFrame( m_uFrameBytes + length );
+                        std::memcpy( m_pFrame + m_uFrameBytes, pBuffer, length );
+                    }
+                    m_uFrameBytes += length;
+                    pBuffer += length;
+                    if ( m_uFrameBytes == m_uFrameSize )
+                        EndFrame();
+                    continue;
+                }
+
+                if ( m_State == State_Data )
+                {
+                    const char* pIAC = (const char*)std::memchr( pBuffer, TNTelnet_IAC, pEnd - pBuffer );
+                    const char* pCopyEnd = pIAC ? pIAC : pEnd;
+                    m_Buffer.insert( m_Buffer.end(), pBuffer, pCopyEnd );
+                    if ( pIAC )
+                        m_State = State_Command;
+                    pBuffer = pIAC ? pIAC + 1 : pEnd;
+                    continue;
+                }
+
+                unsigned char c = (unsigned char)*pBuffer++;
+                switch ( m_State )
+                {
+                case State_Command:
+                    m_State = State_Data;
+                    if ( c == TNTelnet_IAC )
+                    {
+                        m_Buffer.push_back( (char)c ); // escaped 0xFF
+                    }
+                    else if ( c >= TNTelnet_WILL && c <= TNTelnet_DONT )
+                    {
+                        m_uVerb = c;
+                        m_State = State_Option;
+                    }
+                    else if ( c == TNTelnet_SB )
+                    {
+                        m_State = State_SubOption;
+                    }
+                    break; // NOP and the other commands are dropped
+
+                case State_Option:
+                    PushEvent( m_uVerb, c );
+                    m_State = State_Data;
+                    break;
+
+                case State_SubOption:
+                    m_uVerb = c; // keeps the option being negotiated
+                    m_State = State_SubData;
+                    if ( c == TNTelnetOption_Frame )
+                    {
+                        m_uHeaderBytes = 3; // IAC SB option
+                        m_State = State_FrameHeader;
+                    }
+                    break;
+
+                case State_FrameHeader:
+                    m_Header[m_uHeaderBytes++] = c;
+                    if ( m_uHeaderBytes == TNFrame_HeaderSize )
+                        StartFrame();
+                    break;
+
+                case State_SubData:
+                    if ( c == TNTelnet_IAC )
+                        m_State = State_SubCommand;
+                    break;
+
+                case State_SubCommand:
+                    m_State = State_SubData;
+                    if ( c == TNTelnet_SE )
+                    {
+                        PushEvent( TNTelnet_SB, m_uVerb );
+                        m_State = State_Data;
+                        encodingChanged = (m_uVerb == TNTelnetOption_Compress2);
+                    }
+                    break;
+
+                default:
+                    break;
+                }
+            }
+
+            SplitLines();
+
+            return pBuffer - pBegin;
+        }
+
+private:
+
+    enum State
+    {
+        State_Data,
+        State_Command,     // after IAC
+        State_Option,      // after IAC WILL/WONT/DO/DONT
+        State_SubOption,   // after IAC SB
+        State_SubData,     // inside IAC SB <option> ... IAC SE
+        State_SubCommand,  // after IAC inside a subnegotiation
+        State_FrameHeader, // inside the tag and size of a binary frame
+        State_FramePayload, // inside the payload of a binary frame
+        State_FrameSkip     // inside the payload of a frame not accepted
+    };
+
+    void SplitLines()
+        {
+            RawBuffer::iterator it_head = m_Buffer.begin();
+            RawBuffer::iterator it_tail = std::find( it_head, m_Buffer.end(), '\n' );
+            while ( it_tail != m_Buffer.end() )
+            {
+                unsigned int length = (it_tail - it_head);
+                if ( m_Config.uMaxLineLength > 0 && length >= m_Config.uMaxLineLength )
+                {
+                    m_bError = true;
+                    break;
+                }
+                char* pRawNewText = new char[length+2]; // 2 == '\n'+'\0'
+                // std::copy( it_head, it_tail+1, pRawNewText ); // +1 == '\n' // VC++2010 warns std::copy is unsafe
+                std::memcpy( pRawNewText, &(*it_head), length+1 ); // +1 == '\n'
+                pRawNewText[length+1] = '\0';
+                m_Messages.push( new TNMessage(pRawNewText, 0) ); // deleted at DeleteReceivedText
+                it_head = it_tail + 1;
+                if ( it_head == m_Buffer.end() )
+                    break;
+                it_tail = std::find( it_head, m_Buffer.end(), '\n' );
+            }
+
+            // keep the incomplete tail for the next call
+            m_Buffer.erase( m_Buffer.begin(), it_head );
+            if ( m_Config.uMaxLineLength > 0 && m_Buffer.size() >= m_Config.uMaxLineLength )
+                m_bError = true;
+        }
+
+    void StartFrame()
+        {
+            m_uFrameTag  = (unsigned short)((m_Header[3] << 8) | m_Header[4]);
+            m_uFrameSize = ((unsigned int)m_Header[5] << 24) | ((unsigned int)m_Header[6] << 16)
+                         | ((unsigned int)m_Header[7] << 8)  |  (unsigned int)m_Header[8];
+            if ( m_uFrameSize > TNFrame_MaxSize
+              || (m_Config.bFrames && m_uFrameSize > m_Config.uMaxFrameSize) )
+            {
+                m_bError = true;
+                return;
+            }
+
+            // The buffer grows with the payload actually received, so that a
+            // header alone cannot make us allocate.
+            m_uFrameBytes = 0;
+            m_State = m_Config.bFrames ? State_FramePayload : State_FrameSkip;
+            if ( m_uFrameSize == 0 )
+                EndFrame();
+        }
+
+    // Makes room for uBytes of payload and the terminating '\0'.
+    void ReserveFrame( unsigned int uBytes )
+        {
+            if ( m_pFrame != NULL && uBytes < m_uFrameCapacity )
+                return;
+
+            unsigned int capacity = (m_uFrameCapacity > 0) ? m_uFrameCapacity * 2 : 4096;
+            if ( capacity > m_uFrameSize + 1 )
+                capacity = m_uFrameSize + 1;
+            if ( capacity < uBytes + 1 )
+                capacity = uBytes + 1;
+
+            char* pFrame = new char[capacity];
+            if ( m_pFrame != NULL )
+                std::memcpy( pFrame, m_pFrame, m_uFrameBytes );
+            delete [] m_pFrame;
+            m_pFrame = pFrame;
+            m_uFrameCapacity = capacity;
+        }
+
+    // Lines completed before the frame are queued first to keep the order.
+    // A partially received line simply continues after the frame.
+    void EndFrame()
+        {
+            if ( m_State == State_FramePayload )
+            {
+                SplitLines();
+
+                ReserveFrame( m_uFrameSize );
+                m_pFrame[m_uFrameSize] = '\0';
+                m_Messages.push( new TNMessage(m_pFrame, m_uFrameSize, m_uFrameTag, 0) ); // deleted at DeleteReceivedText
+                m_pFrame = NULL;
+                m_uFrameCapacity = 0;
+            }
+            m_State = State_Data;
+        }
+
+    void PushEvent( unsigned char command, unsigned char option )
+        {
+            TNTelnetEvent event;
+            event.Command = command;
+            event.Option  = option;
+            m_Events.push( event );
+        }
+
+    TNReceiveConfig    m_Config;
+    RawBuffer          m_Buffer;
+    TNMessageQueue     m_Messages;
+    TNTelnetEventQueue m_Events;
+    State              m_State;
+    unsigned char      m_uVerb;
+    unsigned char      m_Header[TNFrame_HeaderSize];
+    unsigned int       m_uHeaderBytes;
+    char*              m_pFrame;
+    unsigned int       m_uFrameCapacity;
+    unsigned int       m_uFrameSize;
+    unsigned int       m_uFrameBytes;
+    unsigned short     m_uFrameTag;
+    bool               m_bError;
+}; // End : TNReceiveBuffer
+
+
+#if defined(TN_ENABLE_MCCP)
+// TNCompressorPool : Recycles deflate streams (~256 KiB each) between
+// connections so that reconnecting clients do not pay for allocation.
+class TNCompressorPool
+{
+public:
+    typedef std::vector<z_stream*> StreamList;
+
+    TNCompressorPool( int level = Z_DEFAULT_COMPRESSION, unsigned int uMaxIdle = 16 )
+        : m_Mutex()
+        , m_Idle()
+        , m_Level(level)
+        , m_uMaxIdle(uMaxIdle)
+        {}
+
+    ~TNCompressorPool()
+        {
+            for ( StreamList::iterator it = m_Idle.begin(); it != m_Idle.end(); ++it )
+                Destroy( *it );
+        }
+
+    z_stream* Acquire()
+        {
+            z_stream* pStream = NULL;
+            m_Mutex.Lock();
+            if ( !m_Idle.empty() )
+            {
+                pStream = m_Idle.back();
+                m_Idle.pop_back();
+            }
+            m_Mutex.Unlock();
+
+            if ( pStream == NULL )
+            {
+                pStream = new z_stream;
+                std::memset( pStream, 0, sizeof(z_stream) );
+                if ( deflateInit( pStream, m_Level ) != Z_OK )
+                {
+                    delete pStream;
+                    pStream = NULL;
+                }
+            }
+
+            return pStream;
+        }
+
+    void Release( z_stream* pStream )
+        {
+            if ( pStream == NULL )
+                return;
+
+            deflateReset( pStream );
+
+            m_Mutex.Lock();
+            bool keep = m_Idle.size() < m_uMaxIdle;
+            if ( keep )
+                m_Idle.push_back( pStream );
+            m_Mutex.Unlock();
+
+            if ( !keep )
+                Destroy( pStream );
+        }
+
+private:
+
+    static void Destroy( z_stream* pStream )
+        {
+            deflateEnd( pStream );
+            delete pStream;
+        }
+
+    TNMutex      m_Mutex;
+    StreamList   m_Idle;
+    int          m_Level;
+    unsigned int m_uMaxIdle;
+}; // End : TNCompressorPool
+#endif // defined(TN_ENABLE_MCCP)
+
+
+#if defined(TN_ENABLE_TLS)
+// TNTlsContext : The SSL_CTX of a node, and what outlives its connections:
+// the session a client resumes on reconnect and the handshake counters.
+class TNTlsContext
+{
+public:
+
+    TNTlsContext()
+        : m_Mutex()
+        , m_pContext(NULL)
+        , m_pSession(NULL)
+        , m_bServer(false)
+        , m_ServerName()
+        , m_Stats()
+        {}
+
+    ~TNTlsContext()
+        {
+            Replace( NULL, false, std::string() );
+        }
+
+    // Connections already established keep the previous SSL_CTX, which
+    // OpenSSL frees with the last of them.
+    bool Configure( bool bEnable, const TNTlsConfig& config, bool bServer )
+        {
+            if ( !bEnable )
+            {
+                Replace( NULL, bServer, std::string() );
+                return true;
+            }
+
+            SSL_CTX* pContext = SSL_CTX_new( bServer ? TLS_server_method() : TLS_client_method() );
+            bool result = (pContext != NULL);
+            if ( result )
+            {
+                SSL_CTX_set_min_proto_version( pContext, TLS1_2_VERSION );
+                SSL_CTX_set_app_data( pContext, this );
+            }
+            if ( result && !config.CertificateFile.empty() )
+                result = SSL_CTX_use_certificate_chain_file( pContext, config.CertificateFile.c_str() ) == 1;
+            if ( result && !config.PrivateKeyFile.empty() )
+                result = SSL_CTX_use_PrivateKey_file( pContext, config.PrivateKeyFile.c_str(), SSL_FILETYPE_PEM ) == 1
+                      && SSL_CTX_check_private_key( pContext ) == 1;
+            if ( result && bServer )
+                result = !config.CertificateFile.empty() && !config.PrivateKeyFile.empty();
+            // a client always checks the server; a server asks for client
+            // certificates only when given the CAs to check them with
+            if ( result && config.bVerifyPeer && (!bServer || !config.CaFile.empty()) )
+            {
+                if ( !config.CaFile.empty() )
+                    result = SSL_CTX_load_verify_locations( pContext, config.CaFile.c_str(), NULL ) == 1;
+                else
+                    result = SSL_CTX_set_default_verify_paths( pContext ) == 1;
+                SSL_CTX_set_verify( pContext, bServer ? (SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT) : SSL_VERIFY_PEER, NULL );
+            }
+#  if defined(SSL_OP_ENABLE_KTLS)
+            if ( result && config.bKernelOffload )
+                SSL_CTX_set_options( pContext, SSL_OP_ENABLE_KTLS );
+#  endif
+            if ( result && bServer )
+            {
+                static const unsigned char sessionContext[] = "TelnetNode";
+                SSL_CTX_set_session_id_context( pContext, sessionContext, sizeof(sessionContext) - 1 );
+                if ( !config.bSessionResumption )
+                {
+                    SSL_CTX_set_options( pContext, SSL_OP_NO_TICKET );
+                    SSL_CTX_set_session_cache_mode( pContext, SSL_SESS_CACHE_OFF );
+                    SSL_CTX_set_num_tickets( pContext, 0 );
+                }
+            }
+            else if ( result && config.bSessionResumption )
+            {
+                // TLS 1.3 tickets arrive after the handshake; keep the latest
+                SSL_CTX_set_session_cache_mode( pContext, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE );
+                SSL_CTX_sess_set_new_cb( pContext, NewSessionCallback );
+            }
+
+            if ( !result )
+            {
+                SSL_CTX_free( pContext );
+                ERR_clear_error();
+                return false;
+            }
+
+            Replace( pContext, bServer, config.ServerName );
+            return true;
+        }
+
+    bool IsEnabled()
+        {
+            m_Mutex.Lock();
+            bool result = (m_pContext != NULL);
+            m_Mutex.Unlock();
+
+            return result;
+        }
+
+    // A TLS session for a new connection, or NULL when TLS is off. It reads
+    // from a memory BIO filled by the receive thread and writes to one the
+    // connection empties onto the socket, so that no OpenSSL call waits for
+    // the network. Only for the handshake, when kTLS is enabled, it writes to
+    // the socket: OpenSSL can switch sending to kTLS on a socket BIO alone.
+    SSL* Attach( TNSocketHandle hSocket, const char* pPeerName )
+        {
+            m_Mutex.Lock();
+            SSL* pTls = (m_pContext != NULL) ? SSL_new( m_pContext ) : NULL;
+            bool server = m_bServer;
+            std::string name = m_ServerName.empty() && pPeerName != NULL ? std::string( pPeerName ) : m_ServerName;
+            SSL_SESSION* pSession = m_pSession;
+            if ( pSession != NULL )
+                SSL_SESSION_up_ref( pSession );
+            m_Mutex.Unlock();
+
+            if ( pTls == NULL )
+                return NULL;
+
+            if ( server )
+            {
+                SSL_set_accept_state( pTls );
+            }
+            else
+            {
+                SSL_set_connect_state( pTls );
+                if ( !name.empty() && inet_addr( name.c_str() ) == INADDR_NONE )
+                {
+                    SSL_set_tlsext_host_name( pTls, name.c_str() );
+                    SSL_set1_host( pTls, name.c_str() );
+                }
+                else if ( !name.empty() )
+                {
+                    X509_VERIFY_PARAM_set1_ip_asc( SSL_get0_param(pTls), name.c_str() );
+                }
+                if ( pSession != NULL )
+                {
+                    SSL_set_session( pTls, pSession );
+                    SSL_SESSION_free( pSession );
+                }
+            }
+
+            BIO* pOut = NULL;
+#  if defined(SSL_OP_ENABLE_KTLS)
+            if ( (SSL_get_options(pTls) & SSL_OP_ENABLE_KTLS) != 0 )
+                pOut = BIO_new_socket( (int)hSocket, BIO_NOCLOSE );
+#  endif
+            if ( pOut == NULL )
+                pOut = BIO_new( BIO_s_mem() );
+            SSL_set_bio( pTls, BIO_new( BIO_s_mem() ), pOut );
+
+            return pTls;
+        }
+
+    void Completed( SSL* pTls, bool bKernelOffload )
+        {
+            m_Mutex.Lock();
+            ++m_Stats.uHandshakes;
+            if ( SSL_session_reused(pTls) )
+                ++m_Stats.uResumed;
+            if ( bKernelOffload )
+                ++m_Stats.uKernelOffload;
+            m_Mutex.Unlock();
+        }
+
+    TNTlsStats Stats()
+        {
+            m_Mutex.Lock();
+            TNTlsStats result = m_Stats;
+            m_Mutex.Unlock();
+
+            return result;
+        }
+
+private:
+
+    void Replace( SSL_CTX* pContext, bool bServer, const std::string& serverName )
+        {
+            m_Mutex.Lock();
+            SSL_CTX_free( m_pContext );
+            SSL_SESSION_free( m_pSession );
+            m_pContext   = pContext;
+            m_pSession   = NULL;
+            m_bServer    = bServer;
+            m_ServerName = serverName;
+            m_Mutex.Unlock();
+        }
+
+    static int NewSessionCallback( SSL* pTls, SSL_SESSION* pSession )
+        {
+            TNTlsContext* pThis = (TNTlsContext*)SSL_CTX_get_app_data( SSL_get_SSL_CTX(pTls) );
+            pThis->m_Mutex.Lock();
+            SSL_SESSION_free( pThis->m_pSession );
+            pThis->m_pSession = pSession;
+            pThis->m_Mutex.Unlock();
+
+            return 1; // the reference is ours
+        }
+
+    TNMutex      m_Mutex;
+    SSL_CTX*     m_pContext;
+    SSL_SESSION* m_pSession;   // client: resumed by the next connection
+    bool         m_bServer;
+    std::string  m_ServerName;
+    TNTlsStats   m_Stats;
+}; // End : TNTlsContext
+
+
+#  if defined(TNPLATFORM_UNIX) && !defined(__APPLE__)
+// TNSigPipeGuard : OpenSSL writes to the socket with write(2), which raises
+// SIGPIPE once the peer has reset the connection (plain sends pass
+// MSG_NOSIGNAL instead). Blocks SIGPIPE on the calling thread for the scope
+// and swallows one raised meanwhile.
+class TNSigPipeGuard
+{
+public:
+
+    TNSigPipeGuard()
+        {
+            sigemptyset( &m_SigPipe );
+            sigaddset( &m_SigPipe, SIGPIPE );
+
+            sigset_t pending;
+            sigpending( &pending );
+            m_bWasPending = sigismember( &pending, SIGPIPE ) == 1;
+            pthread_sigmask( SIG_BLOCK, &m_SigPipe, &m_Previous );
+        }
+
+    ~TNSigPipeGuard()
+        {
+            sigset_t pending;
+            sigpending( &pending );
+            if ( !m_bWasPending && sigismember( &pending, SIGPIPE ) == 1 )
+            {
+                timespec immediate = { 0, 0 };
+                sigtimedwait( &m_SigPipe, NULL, &immediate );
+            }
+            pthread_sigmask( SIG_SETMASK, &m_Previous, NULL );
+        }
+
+private:
+
+    sigset_t m_SigPipe;
+    sigset_t m_Previous;
+    bool     m_bWasPending;
+};
+#  else
+// SO_NOSIGPIPE (Apple) or no SIGPIPE at all (Windows)
+struct TNSigPipeGuard {};
+#  endif
+#endif // defined(TN_ENABLE_TLS)
+
+
+// TNConnection : a connection established to the endpoint
+class TNConnection
+{
+public:
+
+    TNConnection( TelnetNode* pNode, TNSocketHandle hSocket, unsigned int uID )
+        : m_Thread()
+        , m_Socket(hSocket)
+        , m_SocketMutex()
+        , m_pNode(pNode)
+        , m_uID(uID)
+        , m_StateMutex()
+        , m_bReceiving(false)
+        , m_Timeouts()
+        , m_Receive()
+        , m_IdleTimer(IdleTimerCallback, this)
+        , m_KeepAliveTimer(KeepAliveTimerCallback, this)
+        , m_DeadlineTimer(DeadlineTimerCallback, this)
+        , m_Pending()
+        , m_FormatBuffers()
+        , m_uBytesSent(0)
+        , m_uSendCalls(0)
+        , m_uRefCount(1)
+        , m_bCompression(false)
+#if defined(TN_ENABLE_MCCP)
+        , m_pDeflate(NULL)
+        , m_pInflate(NULL)
+        , m_Compressed()
+#endif
+#if defined(TN_ENABLE_TLS)
+        , m_TlsMutex()
+        , m_pTls(NULL)
+        , m_bTlsReady(false)
+        , m_bKernelTls(false)
+        , m_TlsHeld()
+        , m_TlsOut()
+        , m_TlsSending()
+        , m_TlsEvent()
+#endif
+        {}
+
+    ~TNConnection()
+        {
+            Close();
+            for ( std::size_t i = 0; i < m_FormatBuffers.size(); ++i )
+                delete m_FormatBuffers[i];
+        }
+
+    // Lets a sender keep using the connection outside the owner's lock while
+    // the owner drops it concurrently. The last Release deletes it.
+    void AddRef()
+        {
+            m_StateMutex.Lock();
+            ++m_uRefCount;
+            m_StateMutex.Unlock();
+        }
+
+    void Release()
+        {
+            m_StateMutex.Lock();
+            bool last = (--m_uRefCount == 0);
+            m_StateMutex.Unlock();
+
+            if ( last )
+                delete this;
+        }
+
+    // Writes beyond this many buffered bytes are sent without waiting for Flush.
+    static const std::size_t PendingLimit = 16384;
+
+    // Sends Telnet protocol bytes as they are, after anything buffered.
+    bool Send( const char* pData, std::size_t uLength )
+        {
+            m_SocketMutex.Lock();
+            m_Pending.insert( m_Pending.end(), pData, pData + uLength );
+            bool result = FlushLocked();
+            UnlockSocket();
+
+            return result;
+        }
+
+    // Buffers the text, IAC bytes doubled; with bFlush everything buffered
+    // goes out in one send.
+    bool Write( const char* pText, std::size_t uLength, bool bFlush )
+        {
+            bool result = true;
+
+            m_SocketMutex.Lock();
+            if ( bFlush && m_Pending.empty() && std::memchr( pText, TNTelnet_IAC, uLength ) == NULL )
+            {
+                result = SendLocked( pText, uLength, 0 ); // nothing to coalesce with
+            }
+            else
+            {
+                AppendEscaped( pText, uLength );
+                if ( bFlush || m_Pending.size() >= PendingLimit )
+                    result = FlushLocked();
+            }
+            UnlockSocket();
+
+            return result;
+        }
+
+    // Header and payload are written under one lock so that no other write
+    // can split the frame. A large payload to be flushed goes out with a
+    // gather write, without being copied into the send buffer.
+    bool WriteFrame( unsigned short uTag, const void* pData, std::size_t uSize, bool bFlush )
+        {
+            if ( uSize > TNFrame_MaxSize )
+                return false;
+
+            const char header[TNFrame_HeaderSize] =
+            {
+                (char)TNTelnet_IAC, (char)TNTelnet_SB, (char)TNTelnetOption_Frame,
+                (char)(uTag >> 8), (char)uTag,
+                (char)(uSize >> 24), (char)(uSize >> 16), (char)(uSize >> 8), (char)uSize
+            };
+            const char* pPayload = (const char*)pData;
+            bool result = true;
+
+            m_SocketMutex.Lock();
+            m_Pending.insert( m_Pending.end(), header, header + TNFrame_HeaderSize );
+            if ( bFlush && uSize >= PendingLimit / 4 )
+            {
+                Slice slices[2] = { { &m_Pending[0], m_Pending.size() }, { pPayload, uSize } };
+                result = SendSlices( slices, 2, 0 );
+                m_Pending.clear();
+            }
+            else
+            {
+                m_Pending.insert( m_Pending.end(), pPayload, pPayload + uSize );
+                if ( bFlush || m_Pending.size() >= PendingLimit )
+                    result = FlushLocked();
+            }
+            UnlockSocket();
+
+            return result;
+        }
+
+    bool Flush()
+        {
+            m_SocketMutex.Lock();
+            bool result = FlushLocked();
+            UnlockSocket();
+
+            return result;
+        }
+
+    // For TNWriter: a buffer to format text into without holding any lock.
+    // Hand it back with ReleaseFormatBuffer.
+    std::vector<char>* AcquireFormatBuffer()
+        {
+            std::vector<char>* pBuffer = NULL;
+            m_StateMutex.Lock();
+            if ( !m_FormatBuffers.empty() )
+            {
+                pBuffer = m_FormatBuffers.back();
+                m_FormatBuffers.pop_back();
+            }
+            m_StateMutex.Unlock();
+
+            return (pBuffer != NULL) ? pBuffer : new std::vector<char>;
+        }
+
+    void ReleaseFormatBuffer( std::vector<char>* pBuffer )
+        {
+            const std::size_t MaxIdle = 4;
+
+            pBuffer->clear();
+            m_StateMutex.Lock();
+            bool keep = (m_FormatBuffers.size() < MaxIdle);
+            if ( keep )
+                m_FormatBuffers.push_back( pBuffer );
+            m_StateMutex.Unlock();
+
+            if ( !keep )
+                delete pBuffer;
+        }
+
+    // For TNWriter: sends formatted text like Write, taking it over without
+    // a copy when the send buffer is empty. text is left empty.
+    bool WriteBuffer( std::vector<char>& text, bool bFlush )
+        {
+            if ( text.empty() )
+                return true;
+
+            bool result = true;
+
+            m_SocketMutex.Lock();
+            bool plain = m_Pending.empty() && std::memchr( &text[0], TNTelnet_IAC, text.size() ) == NULL;
+            if ( plain && bFlush )
+            {
+                result = SendLocked( &text[0], text.size(), 0 ); // nothing to coalesce with
+            }
+            else
+            {
+                if ( plain )
+                    m_Pending.swap( text );
+                else
+                    AppendEscaped( &text[0], text.size() );
+                if ( bFlush || m_Pending.size() >= PendingLimit )
+                    result = FlushLocked();
+            }
+            UnlockSocket();
+            text.clear();
+
+            return result;
+        }
+
+    // For shutdown: the bytes sent so far, unless another thread is sending
+    // at the moment.
+    bool TryBytesSent( unsigned long long& uBytes )
+        {
+            if ( !m_SocketMutex.TryLock() )
+                return false;
+
+            uBytes = m_uBytesSent;
+            m_SocketMutex.Unlock();
+
+            return true;
+        }
+
+    // For shutdown: hands what Write has buffered to the kernel without
+    // blocking. Returns true once nothing is left; false while another
+    // thread is sending or the kernel has no room, to be called again. A
+    // compressed stream cannot stop halfway unless TLS records wrap it, so
+    // what does not fit at once is then given up and added to uLost.
+    bool FlushNonBlocking( unsigned long long& uLost )
+        {
+            if ( !m_SocketMutex.TryLock() )
+                return false;
+
+            if ( !m_Pending.empty() )
+            {
+                if ( IsRawStream() )
+                {
+                    unsigned long long before = m_uBytesSent;
+                    SendRaw( &m_Pending[0], m_Pending.size(), TNSocket_DontWait ); // stops where the kernel is full
+                    m_Pending.erase( m_Pending.begin(), m_Pending.begin() + (std::size_t)(m_uBytesSent - before) );
+                }
+                else
+                {
+                    if ( !SendLocked( &m_Pending[0], m_Pending.size(), TNSocket_DontWait ) && !IsSealedStream() )
+                        uLost += m_Pending.size();
+                    m_Pending.clear();
+                }
+            }
+            bool result = m_Pending.empty();
+#if defined(TN_ENABLE_TLS)
+            if ( result && m_pTls != NULL )
+                result = SendTlsOutput( TNSocket_DontWait ); // records left over last time
+#endif
+            UnlockSocket();
+
+            return result;
+        }
+
+    // For shutdown, after Abort: drops what Write has buffered. Returns the
+    // number of bytes dropped.
+    unsigned long long DiscardPending()
+        {
+            m_SocketMutex.Lock();
+            unsigned long long result = m_Pending.size();
+            m_Pending.clear();
+#if defined(TN_ENABLE_TLS)
+            result += m_TlsSending.size();
+            m_TlsSending.clear();
+            m_TlsMutex.Lock();
+            result += m_TlsOut.size();
+            m_TlsOut.clear();
+            m_TlsMutex.Unlock();
+#endif
+            m_SocketMutex.Unlock();
+
+            return result;
+        }
+
+    // Wakes the receive thread without waiting for it. Safe from any thread.
+    void Wake()
+        {
+            if ( m_Socket != TNSocketHandle_Invalid )
+                shutdown( m_Socket, TNSocketShutdown_Both );
+        }
+
+    // Sends FIN after everything already queued; receiving goes on until the
+    // peer closes its side.
+    void BeginDrain()
+        {
+#if defined(TN_ENABLE_TLS)
+            EndTls();
+#endif
+            if ( m_Socket != TNSocketHandle_Invalid )
+                shutdown( m_Socket, TNSocketShutdown_Send );
+        }
+
+    // Bytes still held in the kernel send queue (unsent or unacknowledged).
+    // Always 0 where the platform cannot tell.
+    unsigned int UnsentBytes()
+        {
+            int pending = 0;
+#if defined(__linux__) && defined(TIOCOUTQ)
+            if ( m_Socket != TNSocketHandle_Invalid && ioctl( m_Socket, TIOCOUTQ, &pending ) != 0 )
+                pending = 0;
+#endif
+            return pending > 0 ? (unsigned int)pending : 0;
+        }
+
+    // Bytes put on the wire (after compression).
+    unsigned long long BytesSent()
+        {
+            m_SocketMutex.Lock();
+            unsigned long long result = m_uBytesSent;
+            m_SocketMutex.Unlock();
+
+            return result;
+        }
+
+    TNTrafficStats Traffic()
+        {
+            TNTrafficStats result;
+            m_SocketMutex.Lock();
+            result.uBytesSent = m_uBytesSent;
+            result.uSendCalls = m_uSendCalls;
+            m_SocketMutex.Unlock();
+
+            return result;
+        }
+
+    // Discards the send queue: the following Close resets the connection.
+    void Abort()
+        {
+            if ( m_Socket != TNSocketHandle_Invalid )
+            {
+                linger discard;
+                discard.l_onoff  = 1;
+                discard.l_linger = 0;
+                setsockopt( m_Socket, SOL_SOCKET, SO_LINGER, (const char*)&discard, sizeof(discard) );
+            }
+            Wake();
+        }
+
+    // The socket handle stays valid until Close, so that timers and other
+    // threads can always 'shutdown' it to wake the receive thread.
+    void Close()
+        {
+            if ( m_Socket != TNSocketHandle_Invalid )
+            {
+#if defined(TN_ENABLE_TLS)
+                EndTls();
+#endif
+                Wake();
+
+                // The receive thread disarms the timers before it exits, so
+                // that the timer thread may close a connection without
+                // taking its own lock again.
+                if ( !m_Thread.IsInvalid() )
+                {
+                    m_Thread.Join();
+                    m_Thread.Invalidate();
+                }
+                else
+                {
+                    DisarmTimers();
+                }
+
+                m_SocketMutex.Lock();
+                closesocket( m_Socket );
+                m_Socket = TNSocketHandle_Invalid;
+#if defined(TN_ENABLE_MCCP)
+                m_pNode->Compressors().Release( m_pDeflate );
+                m_pDeflate = NULL;
+                EndInflate();
+#endif
+#if defined(TN_ENABLE_TLS)
+                m_TlsMutex.Lock();
+                SSL_free( m_pTls );
+                m_pTls = NULL;
+                m_TlsOut.clear();
+                m_TlsMutex.Unlock();
+                m_TlsSending.clear();
+#endif
+                m_SocketMutex.Unlock();
+            }
+        }
+
+    // pPeerName : the address a client connected to, for TLS verification.
+    void Start( const char* pPeerName = NULL )
+        {
+            m_Timeouts = m_pNode->GetTimeouts();
+            m_Receive = m_pNode->GetReceiveConfig();
+            m_bCompression = m_pNode->IsCompressionEnabled();
+            ApplySocketOptions();
+#if defined(TN_ENABLE_TLS)
+            m_pTls = m_pNode->Tls().Attach( m_Socket, pPeerName ); // writes are held until the handshake completes
+#else
+            (void)pPeerName;
+#endif
+
+            if ( m_bCompression && m_pNode->IsServer() )
+                SendCommand( TNTelnet_WILL, TNTelnetOption_Compress2 );
+
+            m_StateMutex.Lock();
+            m_bReceiving = true;
+            m_StateMutex.Unlock();
+
+            Touch( false );
+            m_Thread.Run( ReceiveThreadEntry, this, m_pNode->ReceiveThreadAttributes(m_uID) );
+        }
+
+    // Blocks until the TLS handshake has completed. Returns false if it
+    // failed; true at once without TLS.
+    bool WaitEstablished()
+        {
+#if defined(TN_ENABLE_TLS)
+            for ( ;; )
+            {
+                m_TlsMutex.Lock();
+                bool ready = (m_pTls == NULL) || m_bTlsReady;
+                m_TlsMutex.Unlock();
+
+                if ( ready )
+                    return true;
+                if ( !IsReceiving() )
+                    return false;
+                m_TlsEvent.Wait( 100 );
+            }
+#else
+            return true;
+#endif
+        }
+
+    unsigned int ID() const
+        { return m_uID; }
+
+    // False once the peer has gone (EOF, error or timeout).
+    bool IsReceiving()
+        {
+            m_StateMutex.Lock();
+            bool result = m_bReceiving;
+            m_StateMutex.Unlock();
+
+            return result;
+        }
+
+private:
+
+    struct Slice
+    {
+        const char* pData;
+        std::size_t uSize;
+    };
+
+    static TNThread::RetVal TNAPI ReceiveThreadEntry( void* arg )
+        {
+            ((TNConnection*)arg)->ReceiveThread();
+            TN_TRACE_THREAD_EXIT();
+            TNThread::Exit();
+
+            return 0;
+        }
+
+    void ReceiveThread()
+        {
+            bool done = (m_Socket == TNSocketHandle_Invalid);
+
+            const unsigned int rawBufSize = 8192;
+            char rawBuffer[rawBufSize];
+
+            TNReceiveBuffer receiveBuffer( m_Receive );
+
+#if defined(TN_ENABLE_TLS)
+            if ( !done && m_pTls != NULL && !m_pNode->IsServer() )
+            {
+                m_TlsMutex.Lock();
+                done = !HandshakeLocked(); // queues ClientHello
+                m_TlsMutex.Unlock();
+                SendTlsQueued();
+            }
+#endif
+
+            while ( !done )
+            {
+                int flags = 0;
+                TN_TRACE_BEGIN( recvBegin );
+                int bytes = recv( m_Socket, rawBuffer, rawBufSize, flags );
+                TN_TRACE_END( "recv", recvBegin, (bytes > 0) ? bytes : 0 );
+
+                if ( bytes > 0 )
+                {
+#if defined(TN_ENABLE_TLS)
+                    if ( m_pTls != NULL )
+                        done = !ReceiveTls( rawBuffer, bytes, receiveBuffer );
+                    else
+#endif
+                    Receive( rawBuffer, bytes, receiveBuffer );
+                }
+                else
+                {
+                    done = true;
+                }
+
+                while ( !receiveBuffer.Empty() )
+                {
+                    TNMessagePtr pMsg = receiveBuffer.GetMessage();
+                    pMsg->ID = m_uID;
+                    m_pNode->PushReceivedMessage( pMsg );
+                }
+
+                if ( receiveBuffer.HasError() )
+                {
+                    done = true;
+                    Wake(); // the peer is out of sync
+                }
+
+                if ( !done )
+                    Touch( receiveBuffer.HasPartial() );
+            }
+
+            DisarmTimers();
+
+            m_StateMutex.Lock();
+            m_bReceiving = false;
+            m_StateMutex.Unlock();
+
+#if defined(TN_ENABLE_TLS)
+            m_TlsEvent.Set(); // WaitEstablished gives up
+#endif
+            m_pNode->PushConnectionEvent( TNMessage_Disconnect, m_uID );
+            m_pNode->ConnectionClosed( this ); // whoever closes this joins the thread first
+        }
+
+    // Feeds raw bytes into the receive buffer, decompressing when the peer
+    // has started MCCP2, and answers option negotiations on the way.
+    void Receive( const char* pBuffer, unsigned int uBufferSize, TNReceiveBuffer& receiveBuffer )
+        {
+            TN_TRACE_SCOPE( "append", uBufferSize );
+            while ( uBufferSize > 0 && !receiveBuffer.HasError() ) // Append stops consuming on error
+            {
+                unsigned int consumed = 0;
+#if defined(TN_ENABLE_MCCP)
+                if ( m_pInflate != NULL )
+                    consumed = Inflate( pBuffer, uBufferSize, receiveBuffer );
+                else
+#endif
+                {
+                    consumed = receiveBuffer.Append( pBuffer, uBufferSize );
+                    Negotiate( receiveBuffer );
+                }
+
+                pBuffer += consumed;
+                uBufferSize -= consumed;
+            }
+        }
+
+#if defined(TN_ENABLE_TLS)
+    // Decrypts what recv got and feeds the plain text on. Returns false when
+    // the handshake failed or the TLS session has ended.
+    bool ReceiveTls( const char* pBuffer, unsigned int uBufferSize, TNReceiveBuffer& receiveBuffer )
+        {
+            TNSigPipeGuard guard; // until kTLS is settled, OpenSSL writes to the socket itself
+
+            m_TlsMutex.Lock();
+            BIO_write( SSL_get_rbio(m_pTls), pBuffer, uBufferSize );
+            bool result = HandshakeLocked();
+            m_TlsMutex.Unlock();
+
+            char plain[8192];
+            while ( result )
+            {
+                m_TlsMutex.Lock();
+                int bytes = SSL_read( m_pTls, plain, sizeof(plain) );
+                int error = (bytes > 0) ? SSL_ERROR_NONE : SSL_get_error( m_pTls, bytes );
+                DrainTlsLocked(); // SSL_read may answer, e.g. a key update
+                m_TlsMutex.Unlock();
+
+                if ( bytes <= 0 )
+                {
+                    result = (error == SSL_ERROR_WANT_READ);
+                    break;
+                }
+                Receive( plain, bytes, receiveBuffer );
+            }
+            SendTlsQueued();
+
+            return result;
+        }
+
+    // Sends close_notify unless that could block. OpenSSL only resumes
+    // sessions that were shut down this way.
+    void EndTls()
+        {
+            m_TlsMutex.Lock();
+            if ( m_pTls != NULL && m_bTlsReady && (SSL_get_shutdown(m_pTls) & SSL_SENT_SHUTDOWN) == 0 && IsWritable() )
+            {
+                TNSigPipeGuard guard;
+                SSL_shutdown( m_pTls );
+                DrainTlsLocked();
+            }
+            m_TlsMutex.Unlock();
+            SendTlsQueued();
+        }
+
+    // Advances the handshake; once it completes, encrypts what was written
+    // meanwhile. Returns false if it failed. Caller holds m_TlsMutex.
+    bool HandshakeLocked()
+        {
+            if ( m_bTlsReady )
+                return true;
+
+            TNSigPipeGuard guard;
+            int status = SSL_do_handshake( m_pTls );
+            DrainTlsLocked();
+            if ( status != 1 )
+                return SSL_get_error( m_pTls, status ) == SSL_ERROR_WANT_READ;
+
+            BIO* pOut = SSL_get_wbio( m_pTls );
+            if ( BIO_method_type(pOut) == BIO_TYPE_SOCKET )
+            {
+#  if !defined(OPENSSL_NO_KTLS)
+                m_bKernelTls = BIO_get_ktls_send( pOut ) != 0;
+#  endif
+                if ( !m_bKernelTls )
+                    SSL_set0_wbio( m_pTls, BIO_new( BIO_s_mem() ) ); // no kTLS: encrypt into memory after all
+            }
+            m_bTlsReady = true;
+            m_pNode->Tls().Completed( m_pTls, m_bKernelTls );
+
+            std::size_t written = 0;
+            bool result = m_TlsHeld.empty() || SSL_write_ex( m_pTls, &m_TlsHeld[0], m_TlsHeld.size(), &written ) == 1;
+            std::vector<char>().swap( m_TlsHeld );
+            DrainTlsLocked();
+            m_TlsEvent.Set();
+
+            return result;
+        }
+
+    // Encrypts the slices into m_TlsOut and sends the records. Data is held
+    // back until the handshake has completed; with kTLS the kernel encrypts,
+    // so the plain send path applies. Caller holds m_SocketMutex.
+    bool SendTls( const Slice* pSlices, unsigned int uCount, int extraFlags )
+        {
+            bool result = true;
+            bool kernel = false;
+
+            m_TlsMutex.Lock();
+            if ( !m_bTlsReady )
+            {
+                for ( unsigned int i = 0; i < uCount; ++i )
+                    m_TlsHeld.insert( m_TlsHeld.end(), pSlices[i].pData, pSlices[i].pData + pSlices[i].uSize );
+            }
+            else if ( m_bKernelTls )
+            {
+                kernel = true;
+            }
+            else
+            {
+                for ( unsigned int i = 0; i < uCount && result; ++i )
+                {
+                    std::size_t written = 0;
+                    result = (pSlices[i].uSize == 0) || SSL_write_ex( m_pTls, pSlices[i].pData, pSlices[i].uSize, &written ) == 1;
+                }
+                DrainTlsLocked();
+            }
+            m_TlsMutex.Unlock();
+
+            if ( kernel )
+                return SendPlain( pSlices, uCount, extraFlags );
+
+            return SendTlsOutput( extraFlags ) && result;
+        }
+
+    // Moves what OpenSSL wrote to the memory BIO to m_TlsOut. Nothing to do
+    // while it writes to the socket. Caller holds m_TlsMutex.
+    void DrainTlsLocked()
+        {
+            BIO* pOut = SSL_get_wbio( m_pTls );
+            std::size_t pending = BIO_ctrl_pending( pOut );
+            if ( pending == 0 )
+                return;
+
+            std::size_t used = m_TlsOut.size();
+            m_TlsOut.resize( used + pending );
+            BIO_read( pOut, &m_TlsOut[used], (int)pending );
+        }
+
+    bool HasTlsOutput()
+        {
+            m_TlsMutex.Lock();
+            bool result = !m_TlsOut.empty();
+            m_TlsMutex.Unlock();
+
+            return result;
+        }
+
+    // Sends the records in the order OpenSSL produced them, outside
+    // m_TlsMutex, so that decrypting goes on while the kernel is full. With
+    // TNSocket_DontWait, what does not fit is kept for the next call.
+    // Caller holds m_SocketMutex.
+    bool SendTlsOutput( int extraFlags )
+        {
+            for ( ;; )
+            {
+                if ( m_TlsSending.empty() )
+                {
+                    m_TlsMutex.Lock();
+                    m_TlsSending.swap( m_TlsOut );
+                    m_TlsMutex.Unlock();
+
+                    if ( m_TlsSending.empty() )
+                        return true;
+                }
+
+                unsigned long long before = m_uBytesSent;
+                bool result = SendSocket( &m_TlsSending[0], m_TlsSending.size(), extraFlags );
+                m_TlsSending.erase( m_TlsSending.begin(), m_TlsSending.begin() + (std::size_t)(m_uBytesSent - before) );
+                if ( !result )
+                    return false;
+            }
+        }
+
+    // For threads that must not wait for m_SocketMutex (the receive thread,
+    // shutdown): sends the queued records unless a sender holds the lock, in
+    // which case UnlockSocket sends them.
+    void SendTlsQueued()
+        {
+            if ( HasTlsOutput() && m_SocketMutex.TryLock() )
+            {
+                SendTlsOutput( TNSocket_DontWait );
+                UnlockSocket();
+            }
+        }
+#endif // defined(TN_ENABLE_TLS)
+
+    // Refuses every option except MCCP2, which the server offers and the
+    // client accepts when compression is enabled on both nodes.
+    void Negotiate( TNReceiveBuffer& receiveBuffer )
+        {
+            bool isServer = m_pNode->IsServer();
+            bool compress2 = false;
+
+            TNTelnetEvent event;
+            while ( receiveBuffer.GetEvent(event) )
+            {
+                compress2 = (event.Option == TNTelnetOption_Compress2) && m_bCompression;
+                switch ( event.Command )
+                {
+                case TNTelnet_WILL:
+                    SendCommand( (compress2 && !isServer) ? TNTelnet_DO : TNTelnet_DONT, event.Option );
+                    break;
+
+                case TNTelnet_DO:
+#if defined(TN_ENABLE_MCCP)
+                    if ( compress2 && isServer )
+                    {
+                        StartDeflate();
+                        break;
+                    }
+#endif
+                    SendCommand( TNTelnet_WONT, event.Option );
+                    break;
+
+#if defined(TN_ENABLE_MCCP)
+                case TNTelnet_SB:
+                    if ( compress2 && !isServer )
+                        StartInflate();
+                    break;
+#endif
+
+                default:
+                    break; // WONT/DONT need no answer
+                }
+            }
+        }
+
+    void SendCommand( unsigned char command, unsigned char option )
+        {
+            const char sequence[3] = { (char)TNTelnet_IAC, (char)command, (char)option };
+            Send( sequence, sizeof(sequence) );
+        }
+
+    // Caller holds m_SocketMutex. Telnet reads a 0xFF data byte as IAC, so
+    // text carries it doubled. Frame payloads and commands are not escaped.
+    void AppendEscaped( const char* pText, std::size_t uLength )
+        {
+            const char* pEnd = pText + uLength;
+            for ( ;; )
+            {
+                const char* pIac = (const char*)std::memchr( pText, TNTelnet_IAC, pEnd - pText );
+                if ( pIac == NULL )
+                    break;
+
+                m_Pending.insert( m_Pending.end(), pText, pIac + 1 );
+                m_Pending.push_back( (char)TNTelnet_IAC );
+                pText = pIac + 1;
+            }
+            m_Pending.insert( m_Pending.end(), pText, pEnd );
+        }
+
+    // Caller holds m_SocketMutex. True when the bytes written are the bytes
+    // on the wire, so that a send may stop anywhere and resume later.
+    bool IsRawStream()
+        {
+#if defined(TN_ENABLE_MCCP)
+            if ( m_pDeflate != NULL )
+                return false;
+#endif
+            return !IsSealedStream();
+        }
+
+    // Caller holds m_SocketMutex. True when TLS records are made in user
+    // space: they are queued whole, so sending them may stop anywhere too.
+    bool IsSealedStream()
+        {
+#if defined(TN_ENABLE_TLS)
+            if ( m_pTls != NULL )
+            {
+                m_TlsMutex.Lock();
+                bool result = !m_bKernelTls;
+                m_TlsMutex.Unlock();
+
+                return result;
+            }
+#endif
+            return false;
+        }
+
+    // Releases m_SocketMutex. The receive thread does not wait for it, so TLS
+    // records it queued meanwhile are sent here.
+    void UnlockSocket()
+        {
+#if defined(TN_ENABLE_TLS)
+            bool tls = (m_pTls != NULL);
+            m_SocketMutex.Unlock();
+
+            while ( tls && HasTlsOutput() && m_SocketMutex.TryLock() )
+            {
+                SendTlsOutput( TNSocket_DontWait );
+                m_SocketMutex.Unlock();
+            }
+#else
+            m_SocketMutex.Unlock();
+#endif
+        }
+
+    // Caller holds m_SocketMutex.
+    bool FlushLocked()
+        {
+            if ( m_Pending.empty() )
+                return true;
+
+            bool result = SendLocked( &m_Pending[0], m_Pending.size(), 0 );
+            m_Pending.clear();
+
+            return result;
+        }
+
+    // Caller holds m_SocketMutex.
+    bool SendLocked( const char* pText, std::size_t uLength, int extraFlags )
+        {
+            Slice slice = { pText, uLength };
+            return SendSlices( &slice, 1, extraFlags );
+        }
+
+    // Sends the slices in order with as few system calls as possible.
+    // Caller holds m_SocketMutex.
+    bool SendSlices( Slice* pSlices, unsigned int uCount, int extraFlags )
+        {
+#if defined(TN_ENABLE_MCCP)
+            if ( m_pDeflate != NULL )
+                return SendCompressed( pSlices, uCount, extraFlags );
+#endif
+#if defined(TN_ENABLE_TLS)
+            if ( m_pTls != NULL )
+                return SendTls( pSlices, uCount, extraFlags );
+#endif
+            return SendPlain( pSlices, uCount, extraFlags );
+        }
+
+    // Caller holds m_SocketMutex.
+    bool SendPlain( const Slice* pSlices, unsigned int uCount, int extraFlags )
+        {
+            if ( uCount == 1 )
+                return SendSocket( pSlices[0].pData, pSlices[0].uSize, extraFlags );
+
+#if defined(TNPLATFORM_UNIX)
+            const unsigned int maxSlices = 4;
+            assert( uCount <= maxSlices );
+            iovec vectors[maxSlices];
+            for ( unsigned int i = 0; i < uCount; ++i )
+            {
+                vectors[i].iov_base = (void*)pSlices[i].pData;
+                vectors[i].iov_len  = pSlices[i].uSize;
+            }
+
+            TN_TRACE_SCOPE( "send", uCount );
+
+            msghdr message;
+            std::memset( &message, 0, sizeof(message) );
+            message.msg_iov    = vectors;
+            message.msg_iovlen = uCount;
+            while ( message.msg_iovlen > 0 )
+            {
+                ssize_t bytes = sendmsg( m_Socket, &message, TNSocket_SendFlags | extraFlags );
+                ++m_uSendCalls;
+                if ( bytes < 0 )
+                    return false;
+
+                m_uBytesSent += bytes;
+                while ( message.msg_iovlen > 0 && (std::size_t)bytes >= message.msg_iov->iov_len )
+                {
+                    bytes -= message.msg_iov->iov_len;
+                    ++message.msg_iov;
+                    --message.msg_iovlen;
+                }
+                if ( message.msg_iovlen > 0 )
+                {
+                    message.msg_iov->iov_base = (char*)message.msg_iov->iov_base + bytes;
+                    message.msg_iov->iov_len -= bytes;
+                }
+            }
+
+            return true;
+#elif defined(TNPLATFORM_WINDOWS)
+            for ( unsigned int i = 0; i < uCount; ++i )
+            {
+                if ( !SendSocket(pSlices[i].pData, pSlices[i].uSize, extraFlags) )
+                    return false;
+            }
+
+            return true;
+#endif
+        }
+
+    // Sends bytes that need no more compressing. Caller holds m_SocketMutex.
+    bool SendRaw( const char* pText, std::size_t uLength, int extraFlags = 0 )
+        {
+#if defined(TN_ENABLE_TLS)
+            if ( m_pTls != NULL )
+            {
+                Slice slice = { pText, uLength };
+                return SendTls( &slice, 1, extraFlags );
+            }
+#endif
+            return SendSocket( pText, uLength, extraFlags );
+        }
+
+    // Caller holds m_SocketMutex. With TNSocket_DontWait it stops where the
+    // kernel is full; m_uBytesSent tells how far it got.
+    bool SendSocket( const char* pText, std::size_t uLength, int extraFlags )
+        {
+            TN_TRACE_SCOPE( "send", (unsigned int)uLength );
+
+            int flags = TNSocket_SendFlags | extraFlags;
+            while ( uLength > 0 )
+            {
+                int bytes = send( m_Socket, pText, uLength, flags);
+                ++m_uSendCalls;
+                if ( bytes < 0 )
+                    return false;
+
+                pText += bytes;
+                uLength -= bytes;
+                m_uBytesSent += bytes;
+            }
+
+            return true;
+        }
+
+#if defined(TN_ENABLE_MCCP)
+    // Starts MCCP2 on the send path. Everything after IAC SB COMPRESS2 IAC SE
+    // goes through the deflate stream.
+    void StartDeflate()
+        {
+            m_SocketMutex.Lock();
+            if ( m_pDeflate == NULL )
+            {
+                z_stream* pStream = m_pNode->Compressors().Acquire();
+                if ( pStream != NULL )
+                {
+                    const char start[5] = { (char)TNTelnet_IAC, (char)TNTelnet_SB, (char)TNTelnetOption_Compress2,
+                                            (char)TNTelnet_IAC, (char)TNTelnet_SE };
+                    SendRaw( start, sizeof(start) );
+                    m_pDeflate = pStream;
+                }
+            }
+            UnlockSocket();
+        }
+
+    // Each call ends with Z_SYNC_FLUSH, so the peer can decode everything
+    // sent so far; batching writes (one call per batch) keeps that cheap.
+    bool SendCompressed( const Slice* pSlices, unsigned int uCount, int extraFlags )
+        {
+            std::size_t used = 0;
+            for ( unsigned int i = 0; i < uCount; ++i )
+            {
+                int flush = (i + 1 == uCount) ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+                m_pDeflate->next_in  = (Bytef*)pSlices[i].pData;
+                m_pDeflate->avail_in = (uInt)pSlices[i].uSize;
+                do
+                {
+                    if ( m_Compressed.size() - used < 64 )
+                        m_Compressed.resize( std::max<std::size_t>(m_Compressed.size() * 2, pSlices[i].uSize / 2 + 256) );
+
+                    m_pDeflate->next_out  = (Bytef*)&m_Compressed[used];
+                    m_pDeflate->avail_out = (uInt)(m_Compressed.size() - used);
+                    deflate( m_pDeflate, flush );
+                    used = m_Compressed.size() - m_pDeflate->avail_out;
+                } while ( m_pDeflate->avail_out == 0 || m_pDeflate->avail_in > 0 );
+            }
+
+            return SendRaw( &m_Compressed[0], used, extraFlags );
+        }
+
+    void StartInflate()
+        {
+            if ( m_pInflate != NULL )
+                return;
+
+            m_pInflate = new z_stream;
+            std::memset( m_pInflate, 0, sizeof(z_stream) );
+            if ( inflateInit( m_pInflate ) != Z_OK )
+            {
+                delete m_pInflate;
+                m_pInflate = NULL;
+                Wake(); // the rest of the stream cannot be read
+            }
+        }
+
+    void EndInflate()
+        {
+            if ( m_pInflate != NULL )
+            {
+                inflateEnd( m_pInflate );
+                delete m_pInflate;
+                m_pInflate = NULL;
+            }
+        }
+
+    // Returns the number of compressed bytes consumed; less than
+    // uBufferSize only when the peer ends compression mid-buffer.
+    unsigned int Inflate( const char* pBuffer, unsigned int uBufferSize, TNReceiveBuffer& receiveBuffer )
+        {
+            char inflated[8192];
+            int status = Z_OK;
+
+            m_pInflate->next_in  = (Bytef*)pBuffer;
+            m_pInflate->avail_in = uBufferSize;
+            do
+            {
+                m_pInflate->next_out  = (Bytef*)inflated;
+                m_pInflate->avail_out = sizeof(inflated);
+                status = inflate( m_pInflate, Z_SYNC_FLUSH );
+
+                const char* pOut = inflated;
+                unsigned int uOut = sizeof(inflated) - m_pInflate->avail_out;
+                while ( uOut > 0 && !receiveBuffer.HasError() )
+                {
+                    unsigned int consumed = receiveBuffer.Append( pOut, uOut );
+                    Negotiate( receiveBuffer );
+                    pOut += consumed;
+                    uOut -= consumed;
+                }
+            } while ( status == Z_OK && !receiveBuffer.HasError() && (m_pInflate->avail_in > 0 || m_pInflate->avail_out == 0) );
+
+            unsigned int consumed = uBufferSize - m_pInflate->avail_in;
+            if ( status == Z_STREAM_END )
+            {
+                EndInflate(); // the peer went back to plain text
+            }
+            else if ( status != Z_OK && status != Z_BUF_ERROR )
+            {
+                EndInflate();
+                Wake(); // corrupted stream
+                consumed = uBufferSize;
+            }
+
+            return consumed;
+        }
+#endif // defined(TN_ENABLE_MCCP)
+
+    // True when a small write would not block.
+    bool IsWritable()
+        {
+#if defined(TNPLATFORM_UNIX)
+            pollfd entry;
+            entry.fd      = m_Socket;
+            entry.events  = POLLOUT;
+            entry.revents = 0;
+            return poll( &entry, 1, 0 ) == 1 && (entry.revents & POLLOUT);
+#elif defined(TNPLATFORM_WINDOWS)
+            fd_set writable;
+            FD_ZERO( &writable );
+            FD_SET( m_Socket, &writable );
+            timeval immediate = { 0, 0 };
+            return select( 0, NULL, &writable, NULL, &immediate ) == 1;
+#endif
+        }
+
+    void ApplySocketOptions()
+        {
+#if defined(__APPLE__) && defined(SO_NOSIGPIPE)
+            int noSigPipe = 1;
+            setsockopt( m_Socket, SOL_SOCKET, SO_NOSIGPIPE, (const char*)&noSigPipe, sizeof(noSigPipe) );
+#endif
+            // Coalescing is done by Write/Flush, so Nagle would only add delay.
+            int noDelay = 1;
+            setsockopt( m_Socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay) );
+
+            if ( m_Timeouts.uTcpKeepAliveIdle == 0 )
+                return;
+
+            int enable = 1;
+            setsockopt( m_Socket, SOL_SOCKET, SO_KEEPALIVE, (const char*)&enable, sizeof(enable) );
+#if defined(TCP_KEEPIDLE)
+            int idle = m_Timeouts.uTcpKeepAliveIdle;
+            setsockopt( m_Socket, IPPROTO_TCP, TCP_KEEPIDLE, (const char*)&idle, sizeof(idle) );
+#elif defined(TCP_KEEPALIVE)
+            int idle = m_Timeouts.uTcpKeepAliveIdle;
+            setsockopt( m_Socket, IPPROTO_TCP, TCP_KEEPALIVE, (const char*)&idle, sizeof(idle) );
+#endif
+#if defined(TCP_KEEPINTVL)
+            if ( m_Timeouts.uTcpKeepAliveInterval > 0 )
+            {
+                int interval = m_Timeouts.uTcpKeepAliveInterval;
+                setsockopt( m_Socket, IPPROTO_TCP, TCP_KEEPINTVL, (const char*)&interval, sizeof(interval) );
+            }
+#endif
+#if defined(TCP_KEEPCNT)
+            if ( m_Timeouts.uTcpKeepAliveCount > 0 )
+            {
+                int count = m_Timeouts.uTcpKeepAliveCount;
+                setsockopt( m_Socket, IPPROTO_TCP, TCP_KEEPCNT, (const char*)&count, sizeof(count) );
+            }
+#endif
+        }
+
+    // Called whenever data arrives: restarts the idle/keep-alive clocks and
+    // starts the request deadline on the first byte of a new line.
+    void Touch( bool bPartialLine )
+        {
+            if ( m_Timeouts.uIdleTimeout > 0 )
+                m_pNode->ArmTimer( &m_IdleTimer, m_Timeouts.uIdleTimeout );
+
+            if ( m_Timeouts.uKeepAliveInterval > 0 )
+                m_pNode->ArmTimer( &m_KeepAliveTimer, m_Timeouts.uKeepAliveInterval );
+
+            if ( m_Timeouts.uRequestDeadline > 0 )
+            {
+                if ( !bPartialLine )
+                    m_pNode->DisarmTimer( &m_DeadlineTimer );
+                else if ( !m_DeadlineTimer.IsPending() )
+                    m_pNode->ArmTimer( &m_DeadlineTimer, m_Timeouts.uRequestDeadline );
+            }
+        }
+
+    void DisarmTimers()
+        {
+            m_pNode->DisarmTimer( &m_IdleTimer );
+            m_pNode->DisarmTimer( &m_KeepAliveTimer );
+            m_pNode->DisarmTimer( &m_DeadlineTimer );
+        }
+
+    static void IdleTimerCallback( TNTimerWheel& /*wheel*/, TNTimer* /*pTimer*/, void* arg )
+        {
+            shutdown( ((TNConnection*)arg)->m_Socket, TNSocketShutdown_Both );
+        }
+
+    static void DeadlineTimerCallback( TNTimerWheel& /*wheel*/, TNTimer* /*pTimer*/, void* arg )
+        {
+            shutdown( ((TNConnection*)arg)->m_Socket, TNSocketShutdown_Both );
+        }
+
+    static void KeepAliveTimerCallback( TNTimerWheel& wheel, TNTimer* pTimer, void* arg )
+        {
+            TNConnection* pConnection = (TNConnection*)arg;
+
+            // Skip the ping if an application send is in progress (that
+            // traffic probes the peer just as well) or if it could block the
+            // timer thread. A ping must never be cut short, as it may be part
+            // of the compressed stream.
+            if ( pConnection->m_SocketMutex.TryLock() )
+            {
+                if ( pConnection->IsWritable() )
+                {
+                    static const char nop[2] = { (char)TNTelnet_IAC, (char)TNTelnet_NOP };
+                    pConnection->SendLocked( nop, sizeof(nop), 0 );
+                }
+                pConnection->UnlockSocket();
+            }
+
+            wheel.AddAfter( pTimer, pConnection->m_Timeouts.uKeepAliveInterval );
+        }
+
+    TNThread           m_Thread;
+    TNSocketHandle     m_Socket;
+    TNMutex            m_SocketMutex;
+    TelnetNode*        m_pNode;
+    unsigned int       m_uID;
+    TNMutex            m_StateMutex;
+    bool               m_bReceiving;
+    TNTimeoutConfig    m_Timeouts;
+    TNReceiveConfig    m_Receive;
+    TNTimer            m_IdleTimer;
+    TNTimer            m_KeepAliveTimer;
+    TNTimer            m_DeadlineTimer;
+    std::vector<char>  m_Pending;    // written but not flushed yet
+    std::vector<std::vector<char>*> m_FormatBuffers; // idle TNWriter buffers; guarded by m_StateMutex
+    unsigned long long m_uBytesSent;
+    unsigned long long m_uSendCalls;
+    unsigned int       m_uRefCount;
+    bool               m_bCompression;
+#if defined(TN_ENABLE_MCCP)
+    z_stream*          m_pDeflate;   // guarded by m_SocketMutex
+    z_stream*          m_pInflate;   // used by the receive thread only
+    std::vector<char>  m_Compressed;
+#endif
+#if defined(TN_ENABLE_TLS)
+    TNMutex            m_TlsMutex;   // guards the session and m_TlsOut; taken after m_SocketMutex
+    SSL*               m_pTls;
+    bool               m_bTlsReady;  // handshake completed
+    bool               m_bKernelTls; // sends bypass OpenSSL
+    std::vector<char>  m_TlsHeld;    // written before the handshake completed
+    std::vector<char>  m_TlsOut;     // records not yet taken by a sender
+    std::vector<char>  m_TlsSending; // records being sent; guarded by m_SocketMutex
+    TNEvent            m_TlsEvent;
+#endif
+};
+
+
+// TNTopicTrie : Topic subscriptions of clients.
+// * Topics are dot-separated ("net.rx.errors")
+// * Patterns may use '*' for exactly one segment ("net.*.errors") and a
+//   trailing '**' for zero or more remaining segments ("net.**" matches
+//   "net", "net.rx" and "net.rx.errors")
+// * Lookups walk one trie level per segment; results per concrete topic are
+//   cached until the next subscription change
+// * Not thread-safe; the owner serializes access
+class TNTopicTrie
+{
+public:
+    typedef std::vector<unsigned int> ClientList;
+
+    TNTopicTrie()
+        : m_Root()
+        , m_ClientPatterns()
+        , m_Cache()
+        {}
+
+    ~TNTopicTrie()
+        {}
+
+    static bool IsValidPattern( const std::string& pattern )
+        {
+            Segments segments;
+            Split( pattern, segments );
+            for ( std::size_t i = 0; i < segments.size(); ++i )
+            {
+                if ( segments[i].empty() )
+                    return false;
+                if ( segments[i] == "**" && i + 1 != segments.size() )
+                    return false;
+            }
+
+            return !segments.empty();
+        }
+
+    bool Subscribe( unsigned int uClient, const std::string& pattern )
+        {
+            if ( !IsValidPattern(pattern) )
+                return false;
+
+            if ( !m_ClientPatterns[uClient].insert(pattern).second )
+                return true; // already subscribed
+
+            Segments segments;
+            Split( pattern, segments );
+            Node* pNode = &m_Root;
+            for ( std::size_t i = 0; i < segments.size(); ++i )
+            {
+                Node*& pChild = pNode->Children[segments[i]];
+                if ( pChild == NULL )
+                    pChild = new Node;
+                pNode = pChild;
+            }
+            pNode->Subscribers.insert( uClient );
+
+            m_Cache.clear();
+            return true;
+        }
+
+    bool Unsubscribe( unsigned int uClient, const std::string& pattern )
+        {
+            ClientPatternMap::iterator it = m_ClientPatterns.find( uClient );
+            if ( it == m_ClientPatterns.end() || (*it).second.erase(pattern) == 0 )
+                return false;
+
+            if ( (*it).second.empty() )
+                m_ClientPatterns.erase( it );
+
+            Segments segments;
+            Split( pattern, segments );
+            Remove( m_Root, segments, 0, uClient );
+
+            m_Cache.clear();
+            return true;
+        }
+
+    void RemoveClient( unsigned int uClient )
+        {
+            ClientPatternMap::iterator it = m_ClientPatterns.find( uClient );
+            if ( it == m_ClientPatterns.end() )
+                return;
+
+            PatternSet patterns;
+            patterns.swap( (*it).second );
+            m_ClientPatterns.erase( it );
+
+            for ( PatternSet::iterator pattern = patterns.begin(); pattern != patterns.end(); ++pattern )
+            {
+                Segments segments;
+                Split( *pattern, segments );
+                Remove( m_Root, segments, 0, uClient );
+            }
+
+            m_Cache.clear();
+        }
+
+    // Subscribers of a concrete topic, sorted and without duplicates.
+    const ClientList& Match( const std::string& topic )
+        {
+            CacheMap::iterator cached = m_Cache.find( topic );
+            if ( cached != m_Cache.end() )
+                return (*cached).second;
+
+            if ( m_Cache.size() >= MaxCachedTopics )
+                m_Cache.clear();
+
+            Segments segments;
+            Split( topic, segments );
+
+            ClientList& result = m_Cache[topic];
+            Collect( m_Root, segments, 0, result );
+            std::sort( result.begin(), result.end() );
+            result.erase( std::unique(result.begin(), result.end()), result.end() );
+
+            return result;
+        }
+
+private:
+
+    static const std::size_t MaxCachedTopics = 4096;
+
+    typedef std::vector<std::string> Segments;
+    typedef std::set<std::string> PatternSet;
+    typedef std::map<unsigned int, PatternSet> ClientPatternMap;
+    typedef std::map<std::string, ClientList> CacheMap;
+
+    // Children are held by pointer: a standard container of the still
+    // incomplete Node is undefined behaviour before C++17.
+    struct Node;
+    typedef std::map<std::string, Node*> NodeMap;
+
+    struct Node
+    {
+        NodeMap                Children; // owned
+        std::set<unsigned int> Subscribers;
+
+        Node()
+            : Children()
+            , Subscribers()
+            {}
+
+        ~Node()
+            {
+                for ( NodeMap::iterator it = Children.begin(); it != Children.end(); ++it )
+                    delete (*it).second;
+            }
+
+    private:
+        Node( const Node& other );
+        Node& operator=( const Node& other );
+    };
+
+    static void Split( const std::string& topic, Segments& segments )
+        {
+            std::string::size_type head = 0;
+            for ( ;; )
+            {
+                std::string::size_type tail = topic.find( '.', head );
+                segments.push_back( topic.substr(head, tail - head) );
+                if ( tail == std::string::npos )
+                    break;
+                head = tail + 1;
+            }
+        }
+
+    static void Collect( const Node& node, const Segments& segments, std::size_t depth, ClientList& result )
+        {
+            NodeMap::const_iterator rest = node.Children.find( "**" );
+            if ( rest != node.Children.end() )
+                result.insert( result.end(), (*rest).second->Subscribers.begin(), (*rest).second->Subscribers.end() );
+
+            if ( depth == segments.size() )
+            {
+                result.insert( result.end(), node.Subscribers.begin(), node.Subscribers.end() );
+                return;
+            }
+
+            NodeMap::const_iterator exact = node.Children.find( segments[depth] );
+            if ( exact != node.Children.end() )
+                Collect( *(*exact).second, segments, depth + 1, result );
+
+            NodeMap::const_iterator any = node.Children.find( "*" );
+            if ( any != node.Children.end() )
+                Collect( *(*any).second, segments, depth + 1, result );
+        }
+
+    // Returns true when 'node' became empty and can be pruned.
+    static bool Remove( Node& node, const Segments& segments, std::size_t depth, unsigned int uClient )
+        {
+            if ( depth == segments.size() )
+            {
+                node.Subscribers.erase( uClient );
+            }
+            else
+            {
+                NodeMap::iterator child = node.Children.find( segments[depth] );
+                if ( child != node.Children.end() && Remove(*(*child).second, segments, depth + 1, uClient) )
+                {
+                    delete (*child).second;
+                    node.Children.erase( child );
+                }
+            }
+
+            return node.Subscribers.empty() && node.Children.empty();
+        }
+
+    Node             m_Root;
+    ClientPatternMap m_ClientPatterns;
+    CacheMap         m_Cache;
+}; // End : TNTopicTrie
+
+#endif // TELNETNODEIMPL_H_INCLUDED
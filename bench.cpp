@@ -0,0 +1,396 @@
+#include "TelnetNode.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+// Loopback benchmark : a server and a client in one process.
+//   $ ./bench [port] [none|core|node] [certificate directory]
+//
+// The second argument sets the TNPlacement of both nodes; the benchmark
+// thread is then pinned next to the server's receive thread.
+// The prompt and batched table workloads are repeated over a Unix domain
+// socket and an in-process connection for comparison with TCP.
+// Built with TLS, it also compares handshake rate and bulk throughput with
+// plain TCP, using the certificates made by tls/make-certs.sh (default
+// directory: tls).
+//
+// Every workload is a series of "handlers", each sending some lines to the
+// client and waiting until the client got them all. Latency is measured per
+// handler, from its first SendText to the client receiving its last line.
+
+namespace
+{
+    struct Result
+    {
+        unsigned long long uPayload;
+        unsigned long long uWire;
+        unsigned long long uSendCalls;
+        double             dMeanUs;
+        double             dWorstUs;
+        double             dTotalMs;
+    };
+
+    double NowUs()
+    {
+#if defined(TNPLATFORM_UNIX)
+        timespec ts;
+        clock_gettime( CLOCK_MONOTONIC, &ts );
+        return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+        return TNClock::NowMs() * 1e3;
+#endif
+    }
+
+    // Waits until the client has received 'uLines' lines.
+    void Receive( TelnetNode* pClient, unsigned int uLines )
+    {
+        while ( uLines > 0 )
+        {
+            TNMessagePtr pMsg = pClient->PopReceivedText();
+            if ( pMsg != NULL )
+            {
+                pClient->DeleteReceivedText( pMsg );
+                --uLines;
+            }
+        }
+    }
+
+    enum Workload
+    {
+        Workload_Prompt, // one short line per handler
+        Workload_Table,  // formatted table rows
+        Workload_Log     // log lines
+    };
+
+    void Format( Workload workload, unsigned int i, char* pLine, std::size_t uSize )
+    {
+        switch ( workload )
+        {
+        case Workload_Prompt:
+            snprintf( pLine, uSize, "> ok (%u)\n", i );
+            break;
+        case Workload_Table:
+            snprintf( pLine, uSize, "| %8u | %-16s | %12.4f | %-10s |\n",
+                      i, (i % 3) ? "net.rx" : "render.frame", i * 0.37, (i % 7) ? "OK" : "WARN" );
+            break;
+        case Workload_Log:
+            snprintf( pLine, uSize, "[%010u] INFO  subsystem/%u: processed request id=%u in %u us\n",
+                      i * 17, i % 5, i, (i * 7919) % 1000 );
+            break;
+        }
+    }
+
+    // The same lines as Format, straight into the send buffer.
+    void FormatTo( Workload workload, unsigned int i, TNWriter& out )
+    {
+        switch ( workload )
+        {
+        case Workload_Prompt:
+            out << "> ok (" << i << ")\n";
+            break;
+        case Workload_Table:
+            out.Printf( "| %8u | %-16s | %12.4f | %-10s |\n",
+                        i, (i % 3) ? "net.rx" : "render.frame", i * 0.37, (i % 7) ? "OK" : "WARN" );
+            break;
+        case Workload_Log:
+            out.Printf( "[%010u] INFO  subsystem/%u: processed request id=%u in %u us\n",
+                        i * 17, i % 5, i, (i * 7919) % 1000 );
+            break;
+        }
+    }
+
+    // bWriter: lines are formatted with a TNWriter instead of snprintf and
+    // SendText.
+    Result Measure( TelnetServer* pServer, unsigned int uClient, TelnetNode* pClient,
+                    Workload workload, unsigned int uHandlers, unsigned int uLinesPerHandler, bool bBatch,
+                    bool bWriter = false )
+    {
+        Result result = { 0, 0, 0, 0.0, 0.0, 0.0 };
+        TNTrafficStats before = pServer->GetTrafficStats( uClient );
+
+        double begin = NowUs();
+        char line[160];
+        unsigned int row = 0;
+        for ( unsigned int h = 0; h < uHandlers; ++h )
+        {
+            double start = NowUs();
+            {
+                TNSendBatch batch( bBatch ? pServer : NULL );
+                for ( unsigned int i = 0; i < uLinesPerHandler; ++i, ++row )
+                {
+                    if ( bWriter )
+                    {
+                        TNWriter out = pServer->Writer( uClient );
+                        FormatTo( workload, row, out );
+                        continue;
+                    }
+                    Format( workload, row, line, sizeof(line) );
+                    pServer->SendText( line, uClient );
+                    result.uPayload += std::strlen( line );
+                }
+            }
+            Receive( pClient, uLinesPerHandler );
+            double latency = NowUs() - start;
+
+            result.dMeanUs  += latency;
+            result.dWorstUs  = std::max( result.dWorstUs, latency );
+        }
+        result.dTotalMs = (NowUs() - begin) / 1e3;
+        result.dMeanUs /= uHandlers;
+
+        // the writer does not tell its length; count outside the timing
+        for ( unsigned int i = 0; bWriter && i < row; ++i )
+        {
+            Format( workload, i, line, sizeof(line) );
+            result.uPayload += std::strlen( line );
+        }
+
+        TNTrafficStats after = pServer->GetTrafficStats( uClient );
+        result.uWire      = after.uBytesSent - before.uBytesSent;
+        result.uSendCalls = after.uSendCalls - before.uSendCalls;
+
+        return result;
+    }
+
+    void Print( const char* pName, const Result& result )
+    {
+        std::printf( "%-14s %10llu %10llu %7.1f%% %8llu %10.1f %10.1f %10.1f\n",
+                     pName, result.uPayload, result.uWire,
+                     100.0 * result.uWire / (result.uPayload ? result.uPayload : 1),
+                     result.uSendCalls, result.dMeanUs, result.dWorstUs, result.dTotalMs );
+    }
+
+#if defined(TN_ENABLE_TLS)
+    // One line each way, which also gives a TLS 1.3 client its session
+    // ticket. Returns the client's ID on the server.
+    unsigned int Ping( TelnetServer* pServer, TelnetNode* pClient )
+    {
+        pClient->SendText( "ping\n" );
+        TNMessagePtr pMsg = NULL;
+        while ( (pMsg = pServer->PopReceivedText()) == NULL )
+            pServer->WaitReceivedText( 100 );
+        unsigned int uClient = pMsg->ID;
+        pServer->DeleteReceivedText( pMsg );
+
+        pServer->SendText( "pong\n", uClient );
+        Receive( pClient, 1 );
+
+        return uClient;
+    }
+
+    // Connects, pings and disconnects uConnects times. Returns connects per
+    // second, or 0 when a connect fails.
+    double Reconnect( TelnetServer* pServer, TelnetClient* pClient, unsigned int port, unsigned int uConnects )
+    {
+        double begin = NowUs();
+        for ( unsigned int i = 0; i < uConnects; ++i )
+        {
+            if ( !pClient->Connect("127.0.0.1", port) )
+                return 0.0;
+            Ping( pServer, pClient );
+            pClient->Close();
+        }
+
+        return uConnects / ((NowUs() - begin) / 1e6);
+    }
+
+    // Sends uFrames frames of uSize bytes to the client. Returns MB/s.
+    double Bulk( TelnetServer* pServer, unsigned int uClient, TelnetNode* pClient, unsigned int uFrames, std::size_t uSize )
+    {
+        std::vector<char> payload( uSize, 'x' );
+
+        double begin = NowUs();
+        for ( unsigned int i = 0; i < uFrames; ++i )
+            pServer->SendFrame( 1, &payload[0], uSize, uClient );
+        Receive( pClient, uFrames );
+
+        return uFrames * (double)uSize / (NowUs() - begin);
+    }
+
+    enum Security
+    {
+        Security_Plain,   // no TLS
+        Security_Full,    // TLS, every handshake in full
+        Security_Resumed  // TLS with session tickets
+    };
+
+    bool RunTls( unsigned int port, const std::string& directory, Security security )
+    {
+        TNTlsConfig serverConfig;
+        serverConfig.CertificateFile    = directory + "/server.pem";
+        serverConfig.PrivateKeyFile     = directory + "/server.key";
+        serverConfig.bSessionResumption = (security == Security_Resumed);
+
+        TNTlsConfig clientConfig;
+        clientConfig.CaFile             = directory + "/ca.pem";
+        clientConfig.ServerName         = "localhost";
+        clientConfig.bSessionResumption = (security == Security_Resumed);
+
+        bool secure = (security != Security_Plain);
+        TelnetServer* pServer = new TelnetServer;
+        TelnetClient* pClient = new TelnetClient;
+        TNReceiveConfig receiveConfig;
+        receiveConfig.bFrames       = true; // Bulk sends frames
+        receiveConfig.uMaxFrameSize = 256 * 1024;
+        pClient->SetReceiveConfig( receiveConfig );
+        if ( !pServer->SetTls(secure, serverConfig) || !pClient->SetTls(secure, clientConfig) )
+        {
+            std::printf( "tls: cannot load the certificates in '%s' (run tls/make-certs.sh)\n", directory.c_str() );
+            delete pClient;
+            delete pServer;
+            return false;
+        }
+        if ( !pServer->Listen(port) )
+        {
+            delete pClient;
+            delete pServer;
+            return false;
+        }
+
+        double connects = Reconnect( pServer, pClient, port, 200 );
+        double throughput = 0.0;
+        if ( connects > 0.0 && pClient->Connect("127.0.0.1", port) )
+            throughput = Bulk( pServer, Ping(pServer, pClient), pClient, 128, 256 * 1024 );
+
+        static const char* const names[] = { "plain", "tls", "tls/resumed" };
+        TNTlsStats stats = pServer->GetTlsStats();
+        std::printf( "%-14s %10.0f %10llu %10llu %10llu %10.1f\n",
+                     names[security], connects, stats.uHandshakes, stats.uResumed, stats.uKernelOffload, throughput );
+
+        delete pClient;
+        delete pServer;
+
+        return connects > 0.0 && throughput > 0.0;
+    }
+#endif
+
+    // Learns the client's ID on the server.
+    unsigned int Hello( TelnetServer* pServer, TelnetNode* pClient )
+    {
+        pClient->SendText( "hello\n" );
+        TNMessagePtr pHello = NULL;
+        while ( (pHello = pServer->PopReceivedText()) == NULL )
+            TNThread::Sleep( 1 );
+        unsigned int uClient = pHello->ID;
+        pServer->DeleteReceivedText( pHello );
+
+        return uClient;
+    }
+
+    bool RunTransport( const char* pName, const std::string& uri )
+    {
+        TelnetServer* pServer = new TelnetServer;
+        TelnetClient* pClient = new TelnetClient;
+        if ( !pServer->ListenUri(uri.c_str()) || !pClient->ConnectUri(uri.c_str()) )
+        {
+            std::printf( "%s: cannot connect\n", uri.c_str() );
+            delete pClient;
+            delete pServer;
+            return false;
+        }
+
+        unsigned int uClient = Hello( pServer, pClient );
+        std::string name = pName;
+        Print( (name + " prompt").c_str(), Measure(pServer, uClient, pClient, Workload_Prompt, 2000, 1, false) );
+        Print( (name + " tbl/b").c_str(),  Measure(pServer, uClient, pClient, Workload_Table, 100, 200, true) );
+
+        delete pClient;
+        delete pServer;
+
+        return true;
+    }
+
+    bool Run( unsigned int port, bool bCompression, TNPlacement placement )
+    {
+        TNThreadConfig threads;
+        threads.Placement = placement;
+
+        TelnetServer* pServer = new TelnetServer;
+        pServer->SetCompression( bCompression );
+        pServer->SetThreadConfig( threads );
+        if ( !pServer->Listen(port) )
+        {
+            delete pServer;
+            return false;
+        }
+
+        TelnetClient* pClient = new TelnetClient;
+        pClient->SetCompression( bCompression );
+        pClient->SetThreadConfig( threads );
+        if ( !pClient->Connect("127.0.0.1", port) )
+        {
+            delete pClient;
+            delete pServer;
+            return false;
+        }
+
+        // learn the client ID, and let the option negotiation settle
+        unsigned int uClient = Hello( pServer, pClient );
+        TNThread::Sleep( 50 );
+
+        TNCpuSet cpus = pServer->GetPlacement( uClient );
+        TNThread::SetAffinity( cpus.empty() ? TNTopology::AllowedCpus() : cpus );
+
+        static const char* const placementNames[] = { "none", "core", "node" };
+        std::printf( "compression %s, placement %s\n", bCompression ? "on" : "off", placementNames[placement] );
+        std::printf( "%-14s %10s %10s %8s %8s %10s %10s %10s\n",
+                     "workload", "payload", "wire", "ratio", "sends", "mean[us]", "worst[us]", "total[ms]" );
+        Print( "prompt",        Measure(pServer, uClient, pClient, Workload_Prompt, 2000, 1, false) );
+        Print( "table",         Measure(pServer, uClient, pClient, Workload_Table, 100, 200, false) );
+        Print( "table/batch",   Measure(pServer, uClient, pClient, Workload_Table, 100, 200, true) );
+        Print( "log",           Measure(pServer, uClient, pClient, Workload_Log, 100, 200, false) );
+        Print( "log/batch",     Measure(pServer, uClient, pClient, Workload_Log, 100, 200, true) );
+        Print( "prompt/writer", Measure(pServer, uClient, pClient, Workload_Prompt, 2000, 1, false, true) );
+        Print( "table/writer",  Measure(pServer, uClient, pClient, Workload_Table, 100, 200, true, true) );
+        Print( "log/writer",    Measure(pServer, uClient, pClient, Workload_Log, 100, 200, true, true) );
+        std::puts( "" );
+
+        delete pClient;
+        delete pServer;
+
+        return true;
+    }
+}
+
+int main( int argc, char** argv )
+{
+    unsigned int port = (argc > 1) ? std::atoi( argv[1] ) : 2323;
+    TNPlacement placement = TNPlacement_None;
+    if ( argc > 2 && !std::strcmp(argv[2], "core") )
+        placement = TNPlacement_Core;
+    else if ( argc > 2 && !std::strcmp(argv[2], "node") )
+        placement = TNPlacement_Node;
+
+    TelnetNode::Initialize();
+
+    bool result = Run( port, false, placement );
+#if defined(TN_ENABLE_MCCP)
+    result = result && Run( port + 1, true, placement );
+#endif
+    char tcp[32];
+    std::sprintf( tcp, "tcp://127.0.0.1:%u", port + 5 );
+    std::printf( "%-14s %10s %10s %8s %8s %10s %10s %10s\n",
+                 "transport", "payload", "wire", "ratio", "sends", "mean[us]", "worst[us]", "total[ms]" );
+    result = result && RunTransport( "tcp", tcp );
+#if defined(TNPLATFORM_UNIX)
+    char unixPath[64];
+    std::sprintf( unixPath, "unix:///tmp/telnetnode-bench-%d.sock", (int)getpid() );
+    result = result && RunTransport( "unix", unixPath );
+#endif
+    result = result && RunTransport( "inproc", "inproc://bench" );
+    std::puts( "" );
+
+#if defined(TN_ENABLE_TLS)
+    std::string directory = (argc > 3) ? argv[3] : "tls";
+    std::printf( "%-14s %10s %10s %10s %10s %10s\n",
+                 "transport", "connects/s", "handshakes", "resumed", "kTLS", "bulk[MB/s]" );
+    result = result && RunTls( port + 2, directory, Security_Plain );
+    result = result && RunTls( port + 3, directory, Security_Full );
+    result = result && RunTls( port + 4, directory, Security_Resumed );
+#endif
+
+    TelnetNode::Finalize();
+
+    return result ? 0 : 1;
+}
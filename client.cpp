@@ -4,7 +4,7 @@ int main( int argc, char** argv )
 {
     TelnetNode::Initialize();
 
-    TelnetNode* pClient = TelnetNode::CreateClient();
+    TelnetNode* pClient = (argc > 1) ? TelnetNode::CreateClientUri( argv[1] ) : TelnetNode::CreateClient();
     std::puts( "Client started.");
 
     int nTiming = 0, nSent = 0 ;
@@ -0,0 +1,107 @@
+#include <cstdlib>
+#include "TNEventLoop.h"
+
+// A login prompt and a small wizard per client, written as coroutines.
+// Build with a C++20 compiler: make dialog
+
+#if defined(__cpp_impl_coroutine)
+
+TNTask<bool> Login( TNSession session )
+{
+    for ( int attempt = 0; attempt < 3; ++attempt )
+    {
+        std::string name, password;
+
+        co_await session.Send( "login: " );
+        if ( !co_await session.ReadLine(name, 30000) )
+            co_return false;
+
+        co_await session.Send( "password: " );
+        if ( !co_await session.ReadLine(password, 30000) )
+            co_return false;
+
+        if ( !name.empty() && password == "telnet" )
+            co_return true;
+
+        co_await session.Send( "Login incorrect.\n" );
+    }
+
+    co_return false;
+}
+
+TNTask<> Session( TNEventLoop& loop, TNSession session )
+{
+    std::printf( "Client #%u connected.\n", session.ID() );
+
+    if ( !co_await Login(session) )
+    {
+        session.Disconnect();
+        co_return;
+    }
+
+    co_await session.Send( "Welcome. Commands: echo <text>, wait <ms>, bye, quit\n" );
+
+    std::string line;
+    while ( co_await session.ReadLine(line) )
+    {
+        if ( line.compare(0, 5, "echo ") == 0 )
+        {
+            co_await session.Send( line.substr(5) + "\n" );
+        }
+        else if ( line.compare(0, 5, "wait ") == 0 )
+        {
+            co_await loop.Sleep( std::atoi(line.c_str() + 5) );
+            co_await session.Send( "done\n" );
+        }
+        else if ( line == "bye" )
+        {
+            co_await session.Send( "bye\n" );
+            session.Disconnect();
+        }
+        else if ( line == "quit" )
+        {
+            loop.Stop();
+        }
+    }
+
+    std::printf( "Client #%u left.\n", session.ID() );
+}
+
+TNTask<> Acceptor( TNEventLoop& loop )
+{
+    for (;;)
+        loop.Spawn( Session(loop, co_await loop.Accept()) );
+}
+
+int main( int argc, char** argv )
+{
+    TelnetNode::Initialize();
+
+    unsigned int port = (argc > 1) ? std::atoi( argv[1] ) : 23;
+    TelnetNode* pServer = TelnetNode::CreateServer( port );
+    if ( pServer != NULL )
+    {
+        std::puts( "Dialog server started." );
+        {
+            TNEventLoop loop( pServer );
+            loop.Spawn( Acceptor(loop) );
+            loop.Run();
+        }
+        TelnetNode::ReleaseNode( pServer );
+        std::puts( "Dialog server terminated." );
+    }
+
+    TelnetNode::Finalize();
+
+    return 0;
+}
+
+#else
+
+int main()
+{
+    std::puts( "dialog needs a compiler with C++20 coroutines." );
+    return 1;
+}
+
+#endif
@@ -4,20 +4,41 @@ int main( int argc, char** argv )
 {
     TelnetNode::Initialize();
 
-    TelnetNode* pServer = TelnetNode::CreateServer();
+    // e.g. 'unix:///tmp/telnet.sock' or 'tcp://*:2323'; default: port 23
+    TelnetNode* pServer = (argc > 1) ? TelnetNode::CreateServerUri( argv[1] ) : TelnetNode::CreateServer();
+    if ( pServer )
+    {
+        TNReceiveConfig receiveConfig;
+        receiveConfig.bFrames = true; // printed below
+        pServer->SetReceiveConfig( receiveConfig );
+    }
     std::puts("Server started.");
+#if defined(TNPLATFORM_UNIX)
+    TNTrace::InstallSignal( SIGUSR1 ); // 'kill -USR1 <pid>' dumps trace.json
+#endif
 
     while ( pServer )
     {
+        TNTrace::ExportIfRequested( "trace.json" );
+
         TNMessagePtr pMsg = pServer->PopReceivedText();
         if ( pMsg != NULL )
         {
-            std::printf("Server got message from client #%d. : %s", pMsg->ID, pMsg->Text);
-            if ( !std::strcmp(pMsg->Text, "bye\n") )
+            TN_TRACE_SCOPE( "handler", pMsg->ID );
+            if ( pMsg->IsFrame() )
+                std::printf("Server got frame from client #%d. : tag=%u, %u bytes\n", pMsg->ID, pMsg->Tag, pMsg->Size);
+            else
+                std::printf("Server got message from client #%d. : %s", pMsg->ID, pMsg->Text);
+            if ( !pMsg->IsFrame() && !std::strcmp(pMsg->Text, "bye\n") )
             {
                 pServer->SendText( "bye\n", 0 );
                 break;
             }
+            if ( !pMsg->IsFrame() && !std::strcmp(pMsg->Text, "trace\n") )
+            {
+                bool exported = TNTrace::ExportToFile( "trace.json" );
+                pServer->SendText( exported ? "trace written to trace.json\n" : "tracing is not compiled in\n", pMsg->ID );
+            }
 
             pServer->DeleteReceivedText( pMsg );
         }
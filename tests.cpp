@@ -0,0 +1,233 @@
+#include "TelnetNode.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Self-checks of the library, run by 'make test' and ctest.
+//   $ ./tests [certificate directory]
+//
+// Built with TLS, the TLS checks use the certificates made by
+// tls/make-certs.sh (default directory: tls) and are skipped without them.
+//
+// Prints every failed check and exits with 1 if there was one.
+
+namespace
+{
+    unsigned int g_uFailures = 0;
+
+    void Check( bool bPassed, const char* pWhat, const std::string& detail )
+    {
+        if ( bPassed )
+            return;
+
+        std::printf( "FAILED: %s (%s)\n", pWhat, detail.c_str() );
+        ++g_uFailures;
+    }
+
+    // The next message of pNode, or NULL after uTimeoutMs without one.
+    TNMessagePtr WaitMessage( TelnetNode* pNode, unsigned int uTimeoutMs )
+    {
+        unsigned long long deadline = TNClock::NowMs() + uTimeoutMs;
+        TNMessagePtr pMsg = NULL;
+        while ( (pMsg = pNode->PopReceivedText()) == NULL && TNClock::NowMs() < deadline )
+            pNode->WaitReceivedText( 10 );
+
+        return pMsg;
+    }
+
+    // True if pNode receives exactly pText within a second; returns the
+    // sender's ID in uFrom.
+    bool Expect( TelnetNode* pNode, const char* pText, unsigned int& uFrom )
+    {
+        TNMessagePtr pMsg = WaitMessage( pNode, 1000 );
+        if ( pMsg == NULL )
+            return false;
+
+        bool result = (pMsg->Type == TNMessage_Text) && std::strcmp( pMsg->Text, pText ) == 0;
+        uFrom = pMsg->ID;
+        pNode->DeleteReceivedText( pMsg );
+
+        return result;
+    }
+
+    // A line each way between a server listening on uri and a client
+    // connected to it.
+    void TestRoundTrip( const std::string& uri )
+    {
+        TelnetServer* pServer = new TelnetServer;
+        TelnetClient* pClient = new TelnetClient;
+
+        bool connected = pServer->ListenUri( uri.c_str() ) && pClient->ConnectUri( uri.c_str() );
+        Check( connected, "listen and connect", uri );
+        if ( connected )
+        {
+            unsigned int uClient = 0;
+            pClient->SendText( "ping\n" );
+            Check( Expect(pServer, "ping\n", uClient), "client to server", uri );
+
+            unsigned int uFrom = 0;
+            pServer->SendText( "pong\n", uClient );
+            Check( Expect(pClient, "pong\n", uFrom), "server to client", uri );
+        }
+
+        delete pClient;
+        delete pServer;
+    }
+
+    void TestTransports()
+    {
+        TestRoundTrip( "tcp://127.0.0.1:23231" );
+#if defined(TNPLATFORM_UNIX)
+        char unixUri[64];
+        std::sprintf( unixUri, "unix:///tmp/telnetnode-tests-%d.sock", (int)getpid() );
+        TestRoundTrip( unixUri );
+#endif
+        TestRoundTrip( "inproc://tests" );
+
+        // the URI factories
+        TelnetNode* pServer = TelnetNode::CreateServerUri( "inproc://tests-factory" );
+        TelnetNode* pClient = TelnetNode::CreateClientUri( "inproc://tests-factory" );
+        Check( pServer != NULL && pServer->IsServer(), "CreateServerUri", "inproc://tests-factory" );
+        Check( pClient != NULL && !pClient->IsServer(), "CreateClientUri", "inproc://tests-factory" );
+        if ( pClient != NULL )
+            TelnetNode::ReleaseNode( pClient );
+        if ( pServer != NULL )
+            TelnetNode::ReleaseNode( pServer );
+    }
+
+    void TestInvalidUris()
+    {
+        static const char* const invalid[] =
+        {
+            "",
+            "localhost:23",           // no scheme
+            "udp://127.0.0.1:23",     // unknown scheme
+            "TCP://127.0.0.1:23",     // schemes are lower case
+            "tcp://127.0.0.1",        // no port
+            "tcp://127.0.0.1:",
+            "tcp://127.0.0.1:23x",
+            "tcp://127.0.0.1:65536",
+            "unix://",                // no path
+            "inproc://"               // no name
+        };
+
+        for ( std::size_t i = 0; i < sizeof(invalid) / sizeof(invalid[0]); ++i )
+        {
+            TelnetServer server;
+            TelnetClient client;
+            Check( !server.ListenUri(invalid[i]), "ListenUri refuses", invalid[i] );
+            Check( !client.ConnectUri(invalid[i]), "ConnectUri refuses", invalid[i] );
+            Check( TelnetNode::CreateServerUri(invalid[i]) == NULL, "CreateServerUri refuses", invalid[i] );
+            Check( TelnetNode::CreateClientUri(invalid[i]) == NULL, "CreateClientUri refuses", invalid[i] );
+        }
+
+        TelnetServer server;
+        TelnetServer second;
+        TelnetClient client;
+        Check( !client.ConnectUri("inproc://tests-nobody"), "inproc connect without a server", "inproc://tests-nobody" );
+        Check( server.ListenUri("inproc://tests-taken"), "inproc listen", "inproc://tests-taken" );
+        Check( !second.ListenUri("inproc://tests-taken"), "inproc name in use", "inproc://tests-taken" );
+    }
+
+#if defined(TN_ENABLE_TLS)
+    const unsigned int BulkFrames = 64;
+    const std::size_t  BulkSize   = 256 * 1024;
+
+    TNThread::RetVal TNAPI SendBulk( void* arg )
+    {
+        std::vector<char> payload( BulkSize, 'c' );
+        for ( unsigned int i = 0; i < BulkFrames; ++i )
+            ((TelnetNode*)arg)->SendFrame( 2, &payload[0], BulkSize );
+
+        return 0;
+    }
+
+    // Frames received by pNode within uTimeoutMs, up to uFrames.
+    unsigned int ReceiveFrames( TelnetNode* pNode, unsigned int uFrames, std::size_t uSize, unsigned int uTimeoutMs )
+    {
+        unsigned int received = 0;
+        TNMessagePtr pMsg = NULL;
+        while ( received < uFrames && (pMsg = WaitMessage(pNode, uTimeoutMs)) != NULL )
+        {
+            if ( pMsg->Type == TNMessage_Frame && pMsg->Size == uSize )
+                ++received;
+            pNode->DeleteReceivedText( pMsg );
+        }
+
+        return received;
+    }
+
+    // Both peers send large frames at the same time: neither side's sending
+    // may keep it from decrypting what comes in.
+    void TestTlsBulk( const std::string& directory )
+    {
+        TNTlsConfig serverConfig;
+        serverConfig.CertificateFile = directory + "/server.pem";
+        serverConfig.PrivateKeyFile  = directory + "/server.key";
+
+        TNTlsConfig clientConfig;
+        clientConfig.CaFile     = directory + "/ca.pem";
+        clientConfig.ServerName = "localhost";
+
+        TNReceiveConfig receiveConfig;
+        receiveConfig.bFrames       = true;
+        receiveConfig.uMaxFrameSize = BulkSize;
+
+        TelnetServer* pServer = new TelnetServer;
+        TelnetClient* pClient = new TelnetClient;
+        pServer->SetReceiveConfig( receiveConfig );
+        pClient->SetReceiveConfig( receiveConfig );
+        if ( !pServer->SetTls(true, serverConfig) || !pClient->SetTls(true, clientConfig) )
+        {
+            std::printf( "skipped: TLS checks need the certificates in '%s' (run tls/make-certs.sh)\n", directory.c_str() );
+            delete pClient;
+            delete pServer;
+            return;
+        }
+
+        const char* pUri = "tcp://127.0.0.1:23232";
+        bool connected = pServer->ListenUri( pUri ) && pClient->ConnectUri( pUri );
+        Check( connected, "TLS connect", pUri );
+
+        unsigned int uClient = 0;
+        pClient->SendText( "hello\n" );
+        if ( connected && Expect(pServer, "hello\n", uClient) )
+        {
+            TNThread sender;
+            sender.Run( SendBulk, pClient );
+
+            std::vector<char> payload( BulkSize, 's' );
+            for ( unsigned int i = 0; i < BulkFrames; ++i )
+                pServer->SendFrame( 1, &payload[0], BulkSize, uClient );
+
+            Check( ReceiveFrames(pClient, BulkFrames, BulkSize, 10000) == BulkFrames, "TLS bulk to client", pUri );
+            Check( ReceiveFrames(pServer, BulkFrames, BulkSize, 10000) == BulkFrames, "TLS bulk to server", pUri );
+            sender.Join();
+        }
+
+        delete pClient;
+        delete pServer;
+    }
+#endif
+}
+
+int main( int argc, char** argv )
+{
+    TelnetNode::Initialize();
+
+    TestTransports();
+    TestInvalidUris();
+#if defined(TN_ENABLE_TLS)
+    TestTlsBulk( (argc > 1) ? argv[1] : "tls" );
+#else
+    (void)argc;
+    (void)argv;
+#endif
+
+    TelnetNode::Finalize();
+
+    std::printf( "%s\n", (g_uFailures == 0) ? "all tests passed" : "some tests failed" );
+    return (g_uFailures == 0) ? 0 : 1;
+}
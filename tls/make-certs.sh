@@ -0,0 +1,29 @@
+#!/bin/sh
+# Creates a self-signed test CA and a server certificate signed by it, for
+# TelnetNode built with TLS (make TLS=1). Not for production use.
+#
+#   $ tls/make-certs.sh [directory] [server name]
+#
+# Writes ca.pem, ca.key, server.pem and server.key into the directory
+# (default: the one of this script). The server certificate is valid for
+# 'localhost', 127.0.0.1 and the given name.
+set -e
+
+DIR=${1:-$(dirname "$0")}
+NAME=${2:-localhost}
+DAYS=825
+
+cd "$DIR"
+
+openssl req -x509 -newkey rsa:2048 -nodes -days $DAYS \
+    -keyout ca.key -out ca.pem -subj "/CN=TelnetNode Test CA" 2>/dev/null
+
+openssl req -newkey rsa:2048 -nodes \
+    -keyout server.key -out server.csr -subj "/CN=$NAME" 2>/dev/null
+
+printf 'subjectAltName=DNS:localhost,IP:127.0.0.1,DNS:%s\nextendedKeyUsage=serverAuth\n' "$NAME" > server.ext
+openssl x509 -req -in server.csr -CA ca.pem -CAkey ca.key -CAcreateserial \
+    -days $DAYS -extfile server.ext -out server.pem 2>/dev/null
+
+rm -f server.csr server.ext ca.srl
+echo "$DIR: ca.pem ca.key server.pem server.key"